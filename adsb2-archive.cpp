@@ -0,0 +1,236 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <cstring>
+#include <algorithm>
+#include "adsb2.h"
+
+namespace adsb2 {
+
+    // Study archives: the sax_*/*.dcm members of a tar (plain or gzip-ed)
+    // or zip file are read into memory and decoded from there, so a
+    // study does not have to be extracted into many small files.
+
+    static bool is_zip (fs::path const &path) {
+        return path.extension().string() == ".zip";
+    }
+
+    static bool is_tar (fs::path const &path) {
+        string name = path.filename().native();
+        for (char const *ext: {".tar", ".tar.gz", ".tgz"}) {
+            size_t n = strlen(ext);
+            if (name.size() > n && name.compare(name.size() - n, n, ext) == 0) return true;
+        }
+        return false;
+    }
+
+    // member is <anything>/sax_*/<file>.dcm
+    static bool is_sax_dcm (string const &name) {
+        fs::path p(name);
+        if (p.extension().string() != ".dcm") return false;
+        return p.parent_path().filename().native().find("sax_") == 0;
+    }
+
+    fs::path find_study_archive (fs::path const &path) {
+        if (fs::is_regular_file(path)) {
+            return (is_zip(path) || is_tar(path)) ? path : fs::path();
+        }
+        if (fs::exists(path)) return fs::path();
+        for (char const *ext: {".tar", ".tar.gz", ".tgz", ".zip"}) {
+            fs::path p(path.native() + ext);
+            if (fs::is_regular_file(p)) return p;
+        }
+        return fs::path();
+    }
+
+    static uint64_t tar_number (char const *p, unsigned n) {
+        uint64_t v = 0;
+        for (unsigned i = 0; i < n && p[i]; ++i) {
+            if (p[i] == ' ') continue;
+            CHECK(p[i] >= '0' && p[i] <= '7') << "bad tar header";
+            v = v * 8 + (p[i] - '0');
+        }
+        return v;
+    }
+
+    // one sequential pass, gzread also reads uncompressed files
+    static void read_tar (fs::path const &path, vector<std::pair<string, string>> *members,
+                          std::function<bool (string const &)> const &want) {
+        gzFile f = gzopen(path.c_str(), "rb");
+        CHECK(f) << "cannot open " << path;
+        gzbuffer(f, 1 << 20);
+        auto read = [f, &path](char *buf, size_t n) {
+            while (n) {
+                int r = gzread(f, buf, std::min<size_t>(n, 1 << 30));
+                CHECK(r > 0) << "truncated tar " << path;
+                buf += r;
+                n -= r;
+            }
+        };
+        char header[512];
+        string long_name;
+        string skip;
+        for (;;) {
+            int r = gzread(f, header, sizeof(header));
+            if (r == 0) break;
+            CHECK(r == sizeof(header)) << "truncated tar " << path;
+            if (header[0] == 0) break;      // end of archive
+            uint64_t size = tar_number(header + 124, 12);
+            uint64_t padded = (size + 511) / 512 * 512;
+            char type = header[156];
+            string name;
+            if (long_name.size()) {
+                name.swap(long_name);
+            }
+            else {
+                name.assign(header, strnlen(header, 100));
+                if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+                    name = string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+                }
+            }
+            bool keep = (type == '0' || type == 0) && is_sax_dcm(name);
+            if (keep && want && !want(name)) {
+                members->emplace_back(name, string());     // listed, data skipped
+                keep = false;
+            }
+            if (type == 'L' || type == 'x' || keep) {   // long name, pax header or member we want
+                string data(padded, 0);
+                read(&data[0], padded);
+                data.resize(size);
+                if (type == 'L') {
+                    long_name.assign(data.c_str());
+                }
+                else if (type == 'x') {
+                    // records of "<len> <key>=<value>\n"
+                    size_t off = 0;
+                    while (off < data.size()) {
+                        size_t len = strtoul(data.c_str() + off, nullptr, 10);
+                        size_t sp = data.find(' ', off);
+                        if (len == 0 || off + len > data.size() || sp >= off + len) break;
+                        string rec = data.substr(sp + 1, off + len - sp - 2);
+                        if (rec.compare(0, 5, "path=") == 0) {
+                            long_name = rec.substr(5);
+                        }
+                        off += len;
+                    }
+                }
+                else {
+                    members->emplace_back(name, std::move(data));
+                }
+            }
+            else if (padded) {
+                skip.resize(std::min<uint64_t>(padded, 1 << 20));
+                while (padded) {
+                    size_t n = std::min<uint64_t>(padded, skip.size());
+                    read(&skip[0], n);
+                    padded -= n;
+                }
+            }
+        }
+        gzclose(f);
+    }
+
+    static inline uint32_t le32 (char const *p) {
+        uint8_t const *u = reinterpret_cast<uint8_t const *>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+    }
+
+    static inline uint16_t le16 (char const *p) {
+        uint8_t const *u = reinterpret_cast<uint8_t const *>(p);
+        return u[0] | (u[1] << 8);
+    }
+
+    // central directory, then members inflated in parallel
+    static void read_zip (fs::path const &path, vector<std::pair<string, string>> *members,
+                          std::function<bool (string const &)> const &want) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        CHECK(fd >= 0) << "cannot open " << path;
+        struct stat st;
+        CHECK(fstat(fd, &st) == 0);
+        size_t length = st.st_size;
+        CHECK(length >= 22) << "bad zip " << path;
+        void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        CHECK(p != MAP_FAILED) << "cannot mmap " << path;
+        char const *base = reinterpret_cast<char const *>(p);
+        // end of central directory record, followed by a comment < 64K
+        size_t eocd = length - 22;
+        size_t lowest = length > 22 + 65535 ? length - 22 - 65535 : 0;
+        while (le32(base + eocd) != 0x06054b50) {
+            CHECK(eocd > lowest) << "bad zip " << path;
+            --eocd;
+        }
+        unsigned n = le16(base + eocd + 10);
+        size_t off = le32(base + eocd + 16);
+        CHECK(off != 0xFFFFFFFF) << "zip64 not supported: " << path;
+        struct Entry {
+            string name;
+            int method;
+            size_t data, csize, size;
+            bool read;
+        };
+        vector<Entry> entries;
+        for (unsigned i = 0; i < n; ++i) {
+            CHECK(off + 46 <= length && le32(base + off) == 0x02014b50) << "bad zip " << path;
+            Entry e;
+            e.method = le16(base + off + 10);
+            e.csize = le32(base + off + 20);
+            e.size = le32(base + off + 24);
+            unsigned name_len = le16(base + off + 28);
+            unsigned extra_len = le16(base + off + 30);
+            unsigned comment_len = le16(base + off + 32);
+            size_t local = le32(base + off + 42);
+            e.name.assign(base + off + 46, name_len);
+            off += 46 + name_len + extra_len + comment_len;
+            if (!is_sax_dcm(e.name)) continue;
+            e.read = !want || want(e.name);
+            CHECK(e.method == 0 || e.method == 8) << "unsupported zip method " << e.method << ": " << e.name;
+            CHECK(local + 30 <= length && le32(base + local) == 0x04034b50) << "bad zip " << path;
+            e.data = local + 30 + le16(base + local + 26) + le16(base + local + 28);
+            CHECK(e.data + e.csize <= length) << "truncated zip " << path;
+            entries.push_back(e);
+        }
+        size_t first = members->size();
+        members->resize(first + entries.size());
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
+        for (unsigned i = 0; i < entries.size(); ++i) {
+            Entry const &e = entries[i];
+            auto &m = members->at(first + i);
+            m.first = e.name;
+            if (!e.read) continue;
+            if (e.method == 0) {
+                m.second.assign(base + e.data, e.csize);
+                continue;
+            }
+            m.second.resize(e.size);
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            CHECK(inflateInit2(&z, -MAX_WBITS) == Z_OK);
+            z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(base + e.data));
+            z.avail_in = e.csize;
+            z.next_out = reinterpret_cast<Bytef *>(&m.second[0]);
+            z.avail_out = e.size;
+            int r = inflate(&z, Z_FINISH);
+            CHECK(r == Z_STREAM_END && z.total_out == e.size) << "bad zip member " << e.name;
+            inflateEnd(&z);
+        }
+        munmap(p, length);
+    }
+
+    void read_study_archive (fs::path const &path, vector<std::pair<string, string>> *members,
+                             std::function<bool (string const &)> const &want) {
+        members->clear();
+        if (is_zip(path)) {
+            read_zip(path, members, want);
+        }
+        else {
+            read_tar(path, members, want);
+        }
+        std::sort(members->begin(), members->end(),
+                [](std::pair<string, string> const &a, std::pair<string, string> const &b) {
+                    return fs::path(a.first) < fs::path(b.first);
+                });
+    }
+}
@@ -450,7 +450,7 @@ namespace adsb2 {
             helper(s);
         }
         void apply (Series *ss) const {
-#pragma omp parallel for
+#pragma omp parallel for num_threads(Threads::team())
             for (unsigned i = 0; i < ss->size(); ++i) {
                 helper(&ss->at(i));
             }
@@ -477,9 +477,7 @@ namespace adsb2 {
         for (int y = 0; y < polar.rows; ++y) {
             float *row = polar.ptr<float>(y);
             //for (int x = 0; x <= cc[y]; ++x) {
-            for (int x = 0; x < cc[y]; ++x) {
-                row[x] = 1;
-            }
+            std::fill_n(row, std::max(cc[y], 0), 1.0f);
         }
 
         linearPolar(polar, &slice.images[IM_LABEL], slice.polar_C, slice.polar_R, CV_INTER_NN+CV_WARP_FILL_OUTLIERS+CV_WARP_INVERSE_MAP);
@@ -554,8 +552,9 @@ namespace adsb2 {
         vector<Slice *> tasks;
         study->pool(&tasks);
         CA1 ca1(config);
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
         for (unsigned i = 0; i < tasks.size(); ++i) {
+            ADSB2_TRACE_SCOPE("ca1", tasks[i]->id);
             study_CA1(tasks[i], config, vis);
         }
     }
@@ -102,7 +102,7 @@ namespace adsb2 {
             helper(s);
         }
         void apply (Series *ss) const {
-#pragma omp parallel for
+#pragma omp parallel for num_threads(Threads::team())
             for (unsigned i = 0; i < ss->size(); ++i) {
                 helper(&ss->at(i));
             }
@@ -114,7 +114,7 @@ namespace adsb2 {
         vector<Slice *> tasks;
         study->pool(&tasks);
         CA2 ca1(config);
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
         for (unsigned i = 0; i < tasks.size(); ++i) {
             Slice &slice = *tasks[i];
             if (!slice.images[IM_POLAR_PROB].data) {
@@ -1,4 +1,5 @@
 #pragma once
+#include "adsb2-simd.h"
 
 // common opencv data structure operations
 namespace adsb2 {
@@ -106,11 +107,10 @@ namespace adsb2 {
     void percentile (cv::Mat const &mat, vector<float> const &p, vector<T> *v) {
         vector<T> all;
         CHECK(mat.total());
+        all.reserve(mat.total());
         for (int i = 0; i < mat.rows; ++i) {
             T const *p = mat.ptr<T const>(i);
-            for (int j = 0; j < mat.cols; ++j) {
-                all.push_back(p[j]);
-            }
+            all.insert(all.end(), p, p + mat.cols);
         }
         percentile(all, p, v);
     }
@@ -222,12 +222,35 @@ namespace adsb2 {
         }
     }
 
+    // f(T *row, n) on each row, or once on all pixels of a continuous mat
+    template<typename T, typename F>
+    static inline void loop_rows (cv::Mat &m, F f) {
+        loop_check(m, T());
+        if (m.isContinuous()) {
+            f(m.ptr<T>(0), m.total());
+            return;
+        }
+        for (int i = 0; i < m.rows; ++i) {
+            f(m.ptr<T>(i), m.cols);
+        }
+    }
+
     static inline void color_sum (cv::Mat &color, cv::Mat &mask, float *csum, float *psum) {
-        float cs = 0, ps = 0;
-        loop<float, uint8_t>(color, mask, [&cs, &ps](float a, uint8_t b) {
-                    if (b) cs += a;
-                    ps += b;
-                });
+        loop_check(color, float());
+        loop_check(mask, uint8_t());
+        CHECK(color.size() == mask.size());
+        float cs = 0;
+        uint64_t ps = 0;
+        bool whole = color.isContinuous() && mask.isContinuous();
+        int rows = whole ? 1 : color.rows;
+        int cols = whole ? color.total() : color.cols;
+        for (int i = 0; i < rows; ++i) {
+            float s;
+            uint64_t m;
+            simd::masked_sum(color.ptr<float const>(i), mask.ptr<uint8_t const>(i), cols, &s, &m);
+            cs += s;
+            ps += m;
+        }
         *csum = cs;
         *psum = ps;
     }
@@ -244,10 +267,9 @@ namespace adsb2 {
 
     static constexpr int GRAYS = 256;
     static inline void scale_color(cv::Mat *img, float lb, float ub) {
-        loop<float>(*img, [lb, ub](float &v) {
-            v = std::round((v - lb) * GRAYS / (ub - lb));
-            if (v < 0) v = 0;
-            else if (v >= GRAYS) v =  GRAYS - 1;
+        // round((v - lb) * GRAYS / (ub - lb)) clamped to [0, GRAYS-1]
+        loop_rows<float>(*img, [lb, ub](float *v, size_t n) {
+            simd::affine_round_clamp(v, n, lb, GRAYS, ub - lb, 0, GRAYS - 1);
         });
     }
 
@@ -261,14 +283,12 @@ namespace adsb2 {
         int min_y = m.rows;
         int max_y = -1;
         for (int y = 0; y < m.rows; ++y) {
-            T const *row = m.ptr<T const>(y);
-            for (int x = 0; x < m.cols; ++x) {
-                if (row[x]) { 
-                    min_x = std::min(min_x, x);
-                    max_x = std::max(max_x, x);
-                    min_y = std::min(min_y, y);
-                    max_y = std::max(max_y, y);
-                }
+            size_t first, last;
+            if (simd::nonzero_extent(m.ptr<T const>(y), m.cols, &first, &last)) {
+                min_x = std::min(min_x, int(first));
+                max_x = std::max(max_x, int(last));
+                min_y = std::min(min_y, y);
+                max_y = std::max(max_y, y);
             }
         }
         if ((min_x > max_x) || (min_y > max_y)) *bb = cv::Rect();
@@ -0,0 +1,183 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <caffe/proto/caffe.pb.h>
+#include <caffe/util/db.hpp>
+#include <caffe/util/io.hpp>
+#include "adsb2.h"
+
+namespace adsb2 {
+
+    // Pipelined image/label database builder used by the import tools.
+    //
+    // Producer threads augment and serialize samples in parallel and hand
+    // the records over with put/skip, tagged with a sequence number.
+    // A single writer thread puts the records in sequence order, so the
+    // output does not depend on the number of producers, and commits
+    // every `batch` records per shard.  Producers block when they are
+    // more than `window` records ahead of the writer.  Every sequence
+    // number in [0, N) must be either put or skipped; with a dynamic
+    // schedule the lowest outstanding one is never blocked.
+    //
+    // With shards == 1 the layout is dir/images and dir/labels as before;
+    // otherwise record i goes to dir/<i % shards>/{images,labels}.
+    class DatumWriter {
+        struct Record {
+            bool skip;
+            string image;
+            string label;
+        };
+        struct Shard {
+            std::unique_ptr<caffe::db::DB> image_db;
+            std::unique_ptr<caffe::db::DB> label_db;
+            std::unique_ptr<caffe::db::Transaction> image_txn;
+            std::unique_ptr<caffe::db::Transaction> label_txn;
+            unsigned count;     // records in shard, used as key
+            unsigned pending;   // records since last commit
+        };
+        vector<Shard> shards;
+        unsigned batch;
+        unsigned window;
+        std::mutex mutex;
+        std::condition_variable has_next;   // writer waits
+        std::condition_variable has_room;   // producers wait
+        std::map<uint64_t, Record> queue;   // reorder buffer
+        uint64_t next;                      // next sequence to write
+        unsigned total;
+        bool closing;
+        std::thread writer;
+
+        static void open (caffe::db::DB *db, fs::path const &path) {
+            db->Open(path.string(), caffe::db::NEW);
+        }
+
+        void commit (Shard &s) {
+            s.image_txn->Commit();
+            s.image_txn.reset(s.image_db->NewTransaction());
+            s.label_txn->Commit();
+            s.label_txn.reset(s.label_db->NewTransaction());
+            s.pending = 0;
+        }
+
+        void write (Record const &r) {
+            if (r.skip) return;
+            Shard &s = shards[total % shards.size()];
+            string key = lexical_cast<string>(s.count);
+            s.image_txn->Put(key, r.image);
+            s.label_txn->Put(key, r.label);
+            ++s.count;
+            ++total;
+            if (++s.pending >= batch) {
+                commit(s);
+            }
+        }
+
+        void run () {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                if (queue.size() && queue.begin()->first == next) {
+                    Record r;
+                    std::swap(r, queue.begin()->second);
+                    queue.erase(queue.begin());
+                    ++next;
+                    has_room.notify_all();
+                    lock.unlock();
+                    write(r);
+                    lock.lock();
+                    continue;
+                }
+                if (closing) {
+                    CHECK(queue.empty()) << "sequence " << next << " never produced.";
+                    break;
+                }
+                has_next.wait(lock);
+            }
+        }
+
+        void push (uint64_t seq, Record &&r) {
+            std::unique_lock<std::mutex> lock(mutex);
+            CHECK(seq >= next);
+            has_room.wait(lock, [this, seq]() { return seq < next + window; });
+            queue.emplace(seq, std::move(r));
+            if (seq == next) {
+                has_next.notify_one();
+            }
+        }
+
+    public:
+        DatumWriter (fs::path const &dir, string const &backend,
+                     unsigned n_shards = 1, unsigned batch_ = 1000, unsigned window_ = 256)
+            : shards(n_shards), batch(batch_), window(window_),
+            next(0), total(0), closing(false) {
+            CHECK(n_shards >= 1);
+            CHECK(batch >= 1);
+            CHECK(window >= 1);
+            for (unsigned i = 0; i < shards.size(); ++i) {
+                Shard &s = shards[i];
+                fs::path sdir = dir;
+                if (shards.size() > 1) {
+                    sdir /= fs::path(lexical_cast<string>(i));
+                    fs::create_directories(sdir);
+                }
+                s.image_db.reset(caffe::db::GetDB(backend));
+                open(s.image_db.get(), sdir / fs::path("images"));
+                s.image_txn.reset(s.image_db->NewTransaction());
+                s.label_db.reset(caffe::db::GetDB(backend));
+                open(s.label_db.get(), sdir / fs::path("labels"));
+                s.label_txn.reset(s.label_db->NewTransaction());
+                s.count = s.pending = 0;
+            }
+            writer = std::thread([this]() { run(); });
+        }
+
+        ~DatumWriter () {
+            close();
+        }
+
+        // thread safe, serialization happens in the calling thread
+        void put (uint64_t seq, cv::Mat image, cv::Mat label) {
+            Record r;
+            r.skip = false;
+            caffe::Datum datum;
+            caffe::CVMatToDatum(image, &datum);
+            datum.set_label(0);
+            CHECK(datum.SerializeToString(&r.image));
+            caffe::CVMatToDatum(label, &datum);
+            datum.set_label(0);
+            CHECK(datum.SerializeToString(&r.label));
+            push(seq, std::move(r));
+        }
+
+        // seq produced no record
+        void skip (uint64_t seq) {
+            Record r;
+            r.skip = true;
+            push(seq, std::move(r));
+        }
+
+        // wait for all records and commit
+        void close () {
+            if (!writer.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
+            }
+            has_next.notify_one();
+            writer.join();
+            for (auto &s: shards) {
+                if (s.pending) {
+                    s.image_txn->Commit();
+                    s.label_txn->Commit();
+                    s.pending = 0;
+                }
+            }
+        }
+
+        unsigned size () const {
+            return total;
+        }
+    };
+}
@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include "adsb2.h"
+
+namespace adsb2 {
+
+    // Raw study pack layout.  Sections start at offsets computed from
+    // the counts in the header; frame pixels are 64-byte aligned.
+    //
+    //  RawPackHeader
+    //  RawPack::Series     series[n_series]
+    //  RawPack::Frame      frames[n_frames]    in series order
+    //  char                strings[strings_size]
+    //  uint16_t            pixels              one block per frame
+    //
+    // Frames are stored as Slice::load_raw leaves them (transposed to
+    // landscape), before any study level sanity check, so loading a
+    // pack and loading the DICOM tree give the same Study.
+
+    static char const PACK_MAGIC[8] = {'A', 'D', 'S', 'B', '2', 'R', 'A', 'W'};
+    static uint32_t const PACK_VERSION = 1;
+
+    struct RawPackHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t meta_size;     // sizeof(Meta)
+        uint32_t n_series;
+        uint32_t n_frames;
+        uint64_t strings_size;
+        uint64_t length;        // total file size
+    };
+
+    struct RawPack::Series {
+        uint64_t path_begin;    // into strings
+        uint64_t path_end;
+        uint32_t begin;         // frame range
+        uint32_t end;
+    };
+
+    struct RawPack::Frame {
+        Meta meta;
+        int32_t rows;
+        int32_t cols;
+        uint64_t pixels;        // file offset
+        uint64_t path_begin;
+        uint64_t path_end;
+    };
+
+    static inline size_t align (size_t off, size_t a) {
+        return (off + a - 1) / a * a;
+    }
+
+    int raw_pack = 1;
+
+    bool RawPack::probe (fs::path const &path) {
+        fs::ifstream is(path, std::ios::binary);
+        if (!is) return false;
+        char magic[sizeof(PACK_MAGIC)];
+        is.read(magic, sizeof(magic));
+        if (!is) return false;
+        return memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0;
+    }
+
+    fs::path RawPack::find (fs::path const &path) {
+        if (fs::is_regular_file(path)) {
+            return probe(path) ? path : fs::path();
+        }
+        if (!raw_pack) return fs::path();
+        fs::path pack(path.native() + ".pack");
+        boost::system::error_code ec;
+        std::time_t pack_time = fs::last_write_time(pack, ec);
+        if (ec) return fs::path();
+        if (source_time(path) > pack_time) {
+            LOG(WARNING) << "ignoring stale pack " << pack;
+            return fs::path();
+        }
+        return probe(pack) ? pack : fs::path();
+    }
+
+    std::time_t RawPack::source_time (fs::path const &path) {
+        boost::system::error_code ec;
+        fs::path archive = find_study_archive(path);
+        std::time_t t = fs::last_write_time(archive.empty() ? path : archive, ec);
+        if (ec) return 0;
+        if (!archive.empty()) return t;
+        // files added to or removed from a series only touch its sax_* dir
+        fs::directory_iterator end_itr;
+        for (fs::directory_iterator itr(path, ec); !ec && itr != end_itr; itr.increment(ec)) {
+            if (!fs::is_directory(itr->status())) continue;
+            if (itr->path().filename().native().find("sax_") != 0) continue;
+            boost::system::error_code ec2;
+            std::time_t st = fs::last_write_time(itr->path(), ec2);
+            if (!ec2 && st > t) t = st;
+        }
+        return t;
+    }
+
+    void RawPack::save (fs::path const &path, adsb2::Study const &study) {
+        vector<Series> series;
+        vector<Frame> frames;
+        string strings;
+        size_t n_frames = 0;
+        for (auto const &ss: study) {
+            n_frames += ss.size();
+        }
+        size_t frames_off = align(sizeof(RawPackHeader) + study.size() * sizeof(Series), 8);
+        size_t strings_off = frames_off + n_frames * sizeof(Frame);
+        for (auto const &ss: study) {
+            Series e;
+            e.path_begin = strings.size();
+            strings += ss.dir().native();
+            e.path_end = strings.size();
+            e.begin = frames.size();
+            for (auto const &s: ss) {
+                cv::Mat const &raw = s.images[IM_RAW];
+                CHECK(raw.type() == CV_16U) << "pack needs raw frames: " << s.path;
+                Frame f;
+                f.meta = s.meta;
+                f.rows = raw.rows;
+                f.cols = raw.cols;
+                f.pixels = 0;
+                f.path_begin = strings.size();
+                strings += s.path.native();
+                f.path_end = strings.size();
+                frames.push_back(f);
+            }
+            e.end = frames.size();
+            series.push_back(e);
+        }
+        size_t off = align(strings_off + strings.size(), 64);
+        for (auto &f: frames) {
+            f.pixels = off;
+            off = align(off + size_t(f.rows) * f.cols * sizeof(uint16_t), 64);
+        }
+        RawPackHeader header;
+        memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+        header.version = PACK_VERSION;
+        header.meta_size = sizeof(Meta);
+        header.n_series = series.size();
+        header.n_frames = frames.size();
+        header.strings_size = strings.size();
+        header.length = off;
+
+        fs::path tmp(path.native() + ".tmp");
+        {
+            fs::ofstream os(tmp, std::ios::binary);
+            CHECK(os) << "cannot write " << tmp;
+            size_t pos = 0;
+            auto pad = [&os, &pos](size_t target) {
+                CHECK(pos <= target);
+                for (; pos < target; ++pos) os.put(0);
+            };
+            auto put = [&os, &pos](void const *p, size_t n) {
+                os.write(reinterpret_cast<char const *>(p), n);
+                pos += n;
+            };
+            put(&header, sizeof(header));
+            put(series.data(), series.size() * sizeof(Series));
+            pad(frames_off);
+            put(frames.data(), frames.size() * sizeof(Frame));
+            put(strings.data(), strings.size());
+            unsigned i = 0;
+            for (auto const &ss: study) {
+                for (auto const &s: ss) {
+                    cv::Mat const &raw = s.images[IM_RAW];
+                    pad(frames[i].pixels);
+                    for (int y = 0; y < raw.rows; ++y) {
+                        put(raw.ptr<uint16_t const>(y), raw.cols * sizeof(uint16_t));
+                    }
+                    ++i;
+                }
+            }
+            pad(off);
+            CHECK(os) << "error writing " << tmp;
+        }
+        // readers never see a partial pack
+        fs::rename(tmp, path);
+    }
+
+    RawPack::RawPack (fs::path const &path)
+        : base(nullptr), length(0) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        CHECK(fd >= 0) << "cannot open " << path;
+        struct stat st;
+        CHECK(fstat(fd, &st) == 0);
+        length = st.st_size;
+        CHECK(length >= sizeof(RawPackHeader)) << "bad raw pack " << path;
+        // private writable mapping: frames are handed out as IM_RAW and
+        // a stage writing into one only gets its own copy of the page
+        void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        CHECK(p != MAP_FAILED) << "cannot mmap " << path;
+        base = reinterpret_cast<char *>(p);
+
+        RawPackHeader const *header = reinterpret_cast<RawPackHeader const *>(base);
+        CHECK(memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0) << "bad raw pack " << path;
+        CHECK(header->version == PACK_VERSION) << path << " version " << header->version;
+        CHECK(header->meta_size == sizeof(Meta)) << path << " written with different Meta layout";
+        CHECK(header->length == length) << "truncated raw pack " << path;
+        n_series = header->n_series;
+        series = reinterpret_cast<Series const *>(base + sizeof(RawPackHeader));
+        size_t frames_off = align(sizeof(RawPackHeader) + n_series * sizeof(Series), 8);
+        frames = reinterpret_cast<Frame const *>(base + frames_off);
+        strings = base + frames_off + header->n_frames * sizeof(Frame);
+    }
+
+    RawPack::~RawPack () {
+        if (base) {
+            munmap(base, length);
+        }
+    }
+
+    fs::path RawPack::series_path (unsigned i) const {
+        CHECK(i < n_series);
+        return fs::path(string(strings + series[i].path_begin, strings + series[i].path_end));
+    }
+
+    unsigned RawPack::series_size (unsigned i) const {
+        CHECK(i < n_series);
+        return series[i].end - series[i].begin;
+    }
+
+    void RawPack::frame (unsigned i, unsigned j, fs::path *path, Meta *meta, cv::Mat *raw) const {
+        CHECK(j < series_size(i));
+        Frame const &f = frames[series[i].begin + j];
+        *path = fs::path(string(strings + f.path_begin, strings + f.path_end));
+        *meta = f.meta;
+        *raw = cv::Mat(f.rows, f.cols, CV_16U, base + f.pixels);
+    }
+}
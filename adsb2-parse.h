@@ -0,0 +1,149 @@
+#pragma once
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+namespace adsb2 {
+    // Allocation-free number parsers and formatter for the text formats
+    // we write ourselves (submission csv, dpsmooth input/output).
+    // Locale independent.  Each parser consumes characters in [p, end)
+    // and returns the position after the number, or nullptr if no number
+    // is found.  This header does not depend on the rest of adsb2.
+    namespace parse {
+
+        static inline bool is_space (char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        }
+
+        static inline char const *skip_space (char const *p, char const *end) {
+            while (p < end && is_space(*p)) ++p;
+            return p;
+        }
+
+        static inline char const *parse_int (char const *p, char const *end, int *v) {
+            bool neg = false;
+            if (p < end && (*p == '-' || *p == '+')) {
+                neg = *p == '-';
+                ++p;
+            }
+            char const *b = p;
+            long r = 0;
+            while (p < end && unsigned(*p - '0') < 10) {
+                r = r * 10 + (*p - '0');
+                ++p;
+            }
+            if (p == b) return nullptr;
+            *v = neg ? -r : r;
+            return p;
+        }
+
+        static inline char const *parse_float (char const *p, char const *end, float *v) {
+            // exact powers of ten in double
+            static double const P10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                         1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                         1e20, 1e21, 1e22};
+            static uint64_t const LIMIT = 100000000000000000ULL;  // keep mantissa in 18 digits
+            bool neg = false;
+            if (p < end && (*p == '-' || *p == '+')) {
+                neg = *p == '-';
+                ++p;
+            }
+            uint64_t m = 0;
+            int e10 = 0;
+            bool any = false;
+            while (p < end && unsigned(*p - '0') < 10) {
+                if (m < LIMIT) m = m * 10 + (*p - '0');
+                else ++e10;
+                any = true;
+                ++p;
+            }
+            if (p < end && *p == '.') {
+                ++p;
+                while (p < end && unsigned(*p - '0') < 10) {
+                    if (m < LIMIT) {
+                        m = m * 10 + (*p - '0');
+                        --e10;
+                    }
+                    any = true;
+                    ++p;
+                }
+            }
+            if (!any) return nullptr;
+            if (p < end && (*p == 'e' || *p == 'E')) {
+                int e;
+                char const *q = parse_int(p + 1, end, &e);
+                if (q) {
+                    e10 += e;
+                    p = q;
+                }
+            }
+            double r = double(m);
+            if (m != 0) {
+                if (e10 >= 0 && e10 <= 22) {
+                    r *= P10[e10];
+                }
+                else if (e10 < 0 && e10 >= -22) {
+                    r /= P10[-e10];
+                }
+                else {
+                    r *= std::pow(10.0, e10);
+                }
+            }
+            *v = float(neg ? -r : r);
+            return p;
+        }
+
+        // Writes f exactly as printf("%g") / ostream << f would, returns
+        // the end of output; out needs 16 bytes.  Values outside
+        // [1e-4, 1e6) use snprintf.
+        static inline char *format_float (float f, char *out) {
+            static double const P10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+            double a = std::fabs(double(f));
+            if (!(a >= 1e-4 && a < 999999.5)) {
+                return out + snprintf(out, 16, "%g", f);
+            }
+            char *p = out;
+            if (f < 0) *p++ = '-';
+            int e = int(std::floor(std::log10(a)));
+            if (e < -4) e = -4;
+            if (e > 5) e = 5;
+            // exact: float has 24 bits and 5^9 takes 21
+            double s = a * P10[5 - e];
+            while (s >= 1e6 && e < 5) {
+                ++e;
+                s = a * P10[5 - e];
+            }
+            while (s < 1e5 && e > -4) {
+                --e;
+                s = a * P10[5 - e];
+            }
+            // 6 significant digits, ties to even like printf
+            int64_t d = int64_t(std::nearbyint(s));
+            if (d >= 1000000) {
+                d /= 10;
+                ++e;
+            }
+            char digits[6];
+            for (int i = 5; i >= 0; --i) {
+                digits[i] = '0' + d % 10;
+                d /= 10;
+            }
+            int last = 5;   // strip trailing zeros of the fraction
+            while (last > 0 && last > e && digits[last] == '0') --last;
+            if (e >= 0) {
+                for (int i = 0; i <= e; ++i) *p++ = digits[i];
+                if (last > e) {
+                    *p++ = '.';
+                    for (int i = e + 1; i <= last; ++i) *p++ = digits[i];
+                }
+            }
+            else {
+                *p++ = '0';
+                *p++ = '.';
+                for (int i = 0; i < -e - 1; ++i) *p++ = '0';
+                for (int i = 0; i <= last; ++i) *p++ = digits[i];
+            }
+            return p;
+        }
+    }
+}
@@ -0,0 +1,392 @@
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <sched.h>
+#include <omp.h>
+#include "adsb2.h"
+
+extern "C" {
+// weak: not every build links OpenBLAS
+void    openblas_set_num_threads (int) __attribute__((weak));
+}
+
+namespace adsb2 {
+
+    bool Trace::enabled = false;
+    bool Profile::enabled = false;
+
+    namespace {
+        bool threads_ready = false;
+        int threads_workers = 1;
+        int threads_inner = 1;
+        int threads_node = -1;
+        Config threads_config;      // adsb2.threads
+
+        // cpus of a NUMA node, from its cpulist ("0-7,16-23")
+        void node_cpus (int node, cpu_set_t *set) {
+            fs::path path(fmt::format("/sys/devices/system/node/node{}/cpulist", node));
+            std::ifstream is(path.native());
+            string list;
+            CHECK(std::getline(is, list)) << "no NUMA node " << node;
+            CPU_ZERO(set);
+            istringstream ss(list);
+            string range;
+            while (std::getline(ss, range, ',')) {
+                if (range.empty()) continue;
+                int lo = atoi(range.c_str()), hi = lo;
+                size_t dash = range.find('-');
+                if (dash != range.npos) hi = atoi(range.c_str() + dash + 1);
+                for (int c = lo; c <= hi; ++c) {
+                    CPU_SET(c, set);
+                }
+            }
+            CHECK(CPU_COUNT(set)) << "NUMA node " << node << " has no cpus";
+        }
+
+        // all pools follow the inner count
+        void threads_apply (int inner) {
+            threads_inner = std::max(1, std::min(inner, threads_workers));
+            omp_set_num_threads(Threads::outer());
+            omp_set_max_active_levels(threads_inner > 1 ? 2 : 1);
+            cv::setNumThreads(threads_inner);
+            if (openblas_set_num_threads) {
+                openblas_set_num_threads(threads_inner);
+            }
+        }
+
+        std::mutex profile_mutex;
+        vector<Profile::Stage> profile_stages;  // in first-seen order
+
+        // per-thread ring buffer, owned by trace_buffers and never freed
+        // so it outlives the threads until written at exit
+        struct TraceBuffer {
+            unsigned tid;
+            uint64_t count;     // total events recorded
+            vector<Trace::Event> events;
+        };
+        std::mutex trace_mutex;
+        vector<TraceBuffer *> trace_buffers;
+        unsigned trace_capacity = 0;
+        string trace_path;
+        std::chrono::steady_clock::time_point trace_start;
+        thread_local TraceBuffer *trace_buffer = nullptr;
+
+        void write_trace () {
+            fs::ofstream os(trace_path);
+            if (!os) {
+                LOG(ERROR) << "cannot write trace " << trace_path;
+                return;
+            }
+            Trace::write(os);
+        }
+
+        string json_escape (string const &v) {
+            string r;
+            for (char c: v) {
+                if (c == '"' || c == '\\') r.push_back('\\');
+                r.push_back(c);
+            }
+            return r;
+        }
+    }
+
+    void Trace::setup (string const &path, unsigned events) {
+        if (path.empty() || events == 0) return;
+        trace_path = path;
+        trace_capacity = events;
+        trace_start = std::chrono::steady_clock::now();
+        enabled = true;
+        std::atexit(write_trace);
+    }
+
+    double Trace::now () {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start).count();
+    }
+
+    void Trace::record (char const *name, int64_t arg, double ts, double dur) {
+        TraceBuffer *b = trace_buffer;
+        if (!b) {
+            b = new TraceBuffer;
+            b->count = 0;
+            b->events.resize(trace_capacity);
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            b->tid = trace_buffers.size();
+            trace_buffers.push_back(b);
+            trace_buffer = b;
+        }
+        Event &e = b->events[b->count % b->events.size()];
+        e.name = name;
+        e.arg = arg;
+        e.ts = ts;
+        e.dur = dur;
+        ++b->count;
+    }
+
+    void Trace::write (std::ostream &os) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        os << "{\"traceEvents\": [";
+        bool first = true;
+        for (TraceBuffer const *b: trace_buffers) {
+            os << (first ? "\n" : ",\n")
+               << fmt::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": {}, \"args\": {{\"name\": \"thread {}\"}}}}", b->tid, b->tid);
+            first = false;
+            uint64_t n = b->events.size();
+            uint64_t begin = b->count > n ? b->count - n : 0;
+            for (uint64_t i = begin; i < b->count; ++i) {
+                Event const &e = b->events[i % n];
+                os << ",\n" << fmt::format("{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 0, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}",
+                                          e.name, b->tid, e.ts, e.dur);
+                if (e.arg >= 0) {
+                    os << fmt::format(", \"args\": {{\"id\": {}}}", e.arg);
+                }
+                os << '}';
+            }
+            if (begin) {
+                LOG(WARNING) << "trace thread " << b->tid << " dropped " << begin << " events";
+            }
+        }
+        os << "\n]}" << std::endl;
+    }
+
+    void Threads::setup (Config const &config) {
+        threads_config = config.get_child("adsb2.threads", Config());
+        threads_workers = threads_config.get<int>("workers", 0);
+        int node = threads_config.get<int>("node", -1);
+        if (node >= 0) {
+            // pool threads started from now on inherit the mask; those
+            // already running, like the OpenBLAS servers started when the
+            // library was loaded, are bound one by one
+            cpu_set_t set;
+            node_cpus(node, &set);
+            CHECK(sched_setaffinity(0, sizeof(set), &set) == 0) << "cannot bind to NUMA node " << node;
+            fs::directory_iterator end_itr;
+            for (fs::directory_iterator itr("/proc/self/task"); itr != end_itr; ++itr) {
+                pid_t tid = atoi(itr->path().filename().c_str());
+                if (sched_setaffinity(tid, sizeof(set), &set) != 0) {
+                    LOG(WARNING) << "cannot bind thread " << tid << " to NUMA node " << node;
+                }
+            }
+            threads_node = node;
+            if (threads_workers <= 0) {
+                threads_workers = CPU_COUNT(&set);
+            }
+        }
+        if (threads_workers <= 0) {
+            threads_workers = omp_get_max_threads();
+        }
+        LOG_IF(WARNING, threads_workers > cores()) << threads_workers << " workers on " << cores() << " cores";
+        threads_ready = true;
+        threads_apply(threads_config.get<int>("inner", 1));
+    }
+
+    int Threads::cores () {
+        return omp_get_num_procs();
+    }
+
+    int Threads::workers () {
+        return threads_workers;
+    }
+
+    int Threads::outer () {
+        return std::max(1, threads_workers / threads_inner);
+    }
+
+    int Threads::inner () {
+        return threads_inner;
+    }
+
+    int Threads::team () {
+        return omp_in_parallel() ? threads_inner : outer();
+    }
+
+    int Threads::planned () {
+        return outer() * threads_inner;
+    }
+
+    int Threads::os_threads () {
+        std::ifstream is("/proc/self/status");
+        string line;
+        while (std::getline(is, line)) {
+            if (line.compare(0, 8, "Threads:") == 0) {
+                return atoi(line.c_str() + 8);
+            }
+        }
+        return 0;
+    }
+
+    int Threads::node () {
+        return threads_node;
+    }
+
+    int64_t Threads::remote_kb () {
+        if (threads_node < 0) return 0;
+        // per mapping: "... N0=<pages> N1=<pages> kernelpagesize_kB=4"
+        std::ifstream is("/proc/self/numa_maps");
+        string line;
+        int64_t total = 0;
+        while (std::getline(is, line)) {
+            int64_t page_kb = 4;
+            size_t p = line.find("kernelpagesize_kB=");
+            if (p != line.npos) page_kb = atoll(line.c_str() + p + 18);
+            for (p = line.find(" N"); p != line.npos; p = line.find(" N", p + 2)) {
+                char *end;
+                long n = strtol(line.c_str() + p + 2, &end, 10);
+                if (end == line.c_str() + p + 2 || *end != '=') continue;
+                if (n != threads_node) {
+                    total += atoll(end + 1) * page_kb;
+                }
+            }
+        }
+        return total;
+    }
+
+    Threads::Budget::Budget (char const *stage)
+        : saved_inner(threads_inner), active(false) {
+        if (!threads_ready || omp_in_parallel()) return;
+        auto inner = threads_config.get_optional<int>(string(stage) + ".inner");
+        if (!inner) return;
+        active = true;
+        threads_apply(*inner);
+    }
+
+    Threads::Budget::~Budget () {
+        if (active) {
+            threads_apply(saved_inner);
+        }
+    }
+
+    void Profile::add (Stage const &s) {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        for (auto &x: profile_stages) {
+            if (x.name == s.name) {
+                x.calls += s.calls;
+                x.wall += s.wall;
+                x.user += s.user;
+                x.system += s.system;
+                x.slices += s.slices;
+                x.bytes += s.bytes;
+                x.rss = std::max(x.rss, s.rss);
+                x.threads = std::max(x.threads, s.threads);
+                x.os_threads = std::max(x.os_threads, s.os_threads);
+                x.remote = std::max(x.remote, s.remote);
+                return;
+            }
+        }
+        profile_stages.push_back(s);
+    }
+
+    vector<Profile::Stage> Profile::stages () {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        return profile_stages;
+    }
+
+    void Profile::reset () {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        profile_stages.clear();
+    }
+
+    void Profile::dump_json (std::ostream &os, string const &title) {
+        vector<Stage> v = stages();
+        os << "{\"title\": \"" << json_escape(title) << "\", \"stages\": [";
+        for (unsigned i = 0; i < v.size(); ++i) {
+            Stage const &s = v[i];
+            os << (i ? ",\n  " : "\n  ")
+               << fmt::format("{{\"name\": \"{}\", \"calls\": {}, \"wall\": {:.6f}, \"user\": {:.6f}, \"system\": {:.6f}, \"slices\": {}, \"bytes\": {}, \"rss\": {}, \"threads\": {}, \"os_threads\": {}, \"remote\": {}}}",
+                              s.name, s.calls, s.wall, s.user, s.system, s.slices, s.bytes, s.rss, s.threads, s.os_threads, s.remote);
+        }
+        os << "\n]}" << std::endl;
+    }
+
+    void Profile::dump_csv (std::ostream &os) {
+        os << "name,calls,wall,user,system,slices,bytes,rss,threads,os_threads,remote" << std::endl;
+        for (auto const &s: stages()) {
+            os << fmt::format("{},{},{:.6f},{:.6f},{:.6f},{},{},{},{},{},{}",
+                              s.name, s.calls, s.wall, s.user, s.system, s.slices, s.bytes, s.rss, s.threads, s.os_threads, s.remote) << std::endl;
+        }
+    }
+
+    int64_t Profile::peak_rss () {
+        // VmHWM follows reset_peak_rss, ru_maxrss does not always
+        std::ifstream is("/proc/self/status");
+        string line;
+        while (std::getline(is, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                int64_t v = 0;
+                istringstream ss(line.substr(6));   // "VmHWM:   1688 kB"
+                ss >> v;
+                return v;
+            }
+        }
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        return usage.ru_maxrss;
+    }
+
+    bool Profile::reset_peak_rss () {
+        std::ofstream os("/proc/self/clear_refs");
+        os << "5" << std::flush;
+        return bool(os);
+    }
+
+    int64_t image_bytes (Study const &study) {
+        // images may share buffers, count each once
+        std::unordered_set<uchar const *> seen;
+        int64_t total = 0;
+        auto count = [&seen, &total](cv::Mat const &m) {
+            if (m.empty()) return;
+            if (!seen.insert(m.datastart).second) return;
+            total += m.dataend - m.datastart;
+        };
+        for (auto const &ss: study) {
+            for (auto const &s: ss) {
+                for (auto const &m: s.images) {
+                    count(m);
+                }
+                count(s._extra);
+            }
+        }
+        return total;
+    }
+
+    Profile::Scope::Scope (char const *name_, Study const *study_)
+        : name(name_), study(study_), n_slices(0), bytes0(0), trace(name_), budget(name_) {
+        if (!enabled) return;
+        if (study) {
+            for (auto const &ss: *study) {
+                n_slices += ss.size();
+            }
+            bytes0 = image_bytes(*study);
+        }
+        timer.reset(new boost::timer::cpu_timer);
+    }
+
+    Profile::Scope::~Scope () {
+        if (!timer) return;
+        timer->stop();
+        boost::timer::cpu_times t = timer->elapsed();
+        Stage s;
+        s.name = name;
+        s.calls = 1;
+        s.wall = t.wall / 1e9;
+        s.user = t.user / 1e9;
+        s.system = t.system / 1e9;
+        s.slices = n_slices;
+        s.bytes = 0;
+        s.rss = peak_rss();
+        s.threads = Threads::planned();
+        s.os_threads = Threads::os_threads();
+        s.remote = Threads::remote_kb();
+        if (study) {
+            // study may be filled or emptied by the stage
+            uint64_t n = 0;
+            for (auto const &ss: *study) {
+                n += ss.size();
+            }
+            s.slices = std::max(s.slices, n);
+            s.bytes = image_bytes(*study) - bytes0;
+        }
+        add(s);
+    }
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <boost/timer/timer.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace adsb2 {
+
+    class Study;
+
+    // Event tracing in Chrome trace format (chrome://tracing, Perfetto).
+    // Each thread records complete events into its own ring buffer,
+    // keeping the latest adsb2.trace.events; all buffers are written to
+    // adsb2.trace.path at exit.  Only built with -DADSB2_TRACE (make
+    // TRACE=1); otherwise ADSB2_TRACE_SCOPE expands to nothing and
+    // Trace::enabled stays false.  Names must be string literals.
+    class Trace {
+    public:
+        struct Event {
+            char const *name;
+            int64_t arg;        // slice id etc., -1 if none
+            double ts;          // microseconds since setup
+            double dur;
+        };
+
+        static bool enabled;
+
+        static void setup (std::string const &path, unsigned events);
+        static double now ();
+        static void record (char const *name, int64_t arg, double ts, double dur);
+        static void write (std::ostream &os);
+
+        class Scope {
+            char const *name;
+            int64_t arg;
+            double ts;
+        public:
+            Scope (char const *name_, int64_t arg_ = -1)
+                : name(name_), arg(arg_), ts(enabled ? now() : 0) {
+            }
+            ~Scope () {
+                if (enabled) {
+                    record(name, arg, ts, now() - ts);
+                }
+            }
+        };
+    };
+
+#ifdef ADSB2_TRACE
+#define ADSB2_TRACE_CONCAT2(a, b) a##b
+#define ADSB2_TRACE_CONCAT(a, b) ADSB2_TRACE_CONCAT2(a, b)
+#define ADSB2_TRACE_SCOPE(...) ::adsb2::Trace::Scope ADSB2_TRACE_CONCAT(_trace_, __LINE__)(__VA_ARGS__)
+#else
+#define ADSB2_TRACE_SCOPE(...) do {} while (0)
+#endif
+
+    // Threading runtime.  Owns the worker count (adsb2.threads.workers,
+    // default OMP_NUM_THREADS or all cores) shared by the three pools of
+    // the process: OpenMP, OpenCV's and OpenBLAS's (inside caffe).
+    // A stage budget splits the workers into outer threads, running the
+    // stage's own parallel loop, and inner threads for what each outer
+    // thread calls: nested parallel loops, OpenCV and BLAS.  The inner
+    // count comes from adsb2.threads.<stage>.inner (default 1, nested
+    // loops run serially) and outer is workers / inner, so the product
+    // never exceeds the worker count.  Parallel loops that may run
+    // nested take num_threads(Threads::team()).
+    //
+    // NUMA mode (adsb2.threads.node=<n>) binds the process to the cpus
+    // of node n in setup, and workers default to their number.  Pools
+    // started later inherit the mask; threads started earlier, such as
+    // the OpenBLAS servers created at load time, are bound in setup,
+    // but their buffers may already be on another node.  Threads then
+    // first-touch frames and their own detector replicas on that node;
+    // a batch runs one process per node under numactl (numa-study.sh).
+    class Threads {
+    public:
+        static void setup (boost::property_tree::ptree const &config);
+        static int cores ();
+        static int workers ();
+        static int outer ();
+        static int inner ();
+        // threads for a parallel loop started here
+        static int team ();
+        // threads the current budget can keep busy, outer * inner
+        static int planned ();
+        // OS threads of the process, idle pool threads included
+        static int os_threads ();
+        // bound NUMA node, -1 if not in NUMA mode
+        static int node ();
+        // KB of the process on other nodes than the bound one,
+        // 0 if not in NUMA mode
+        static int64_t remote_kb ();
+
+        // Stage budget, restored at the end of the scope.  Only takes
+        // effect outside parallel regions; nested stages keep the
+        // budget of the enclosing one.
+        class Budget {
+            int saved_inner;
+            bool active;
+        public:
+            Budget (char const *stage);
+            ~Budget ();
+        };
+    };
+
+    // Stage profiling.
+    // A Profile::Scope measures one run of a pipeline stage, and the
+    // totals are accumulated per stage name in a process-wide registry,
+    // kept in first-seen order.  Enabled by adsb2.profile (GlobalInit);
+    // a disabled Scope costs a branch, no timer is started.  Scopes also
+    // show up as stage events in the trace, and set the thread budget
+    // of the stage whether profiling is enabled or not.
+    class Profile {
+    public:
+        struct Stage {
+            std::string name;
+            uint64_t calls;
+            double wall;        // seconds
+            double user;        // cpu seconds of all threads
+            double system;
+            uint64_t slices;    // slices processed
+            int64_t bytes;      // net slice image memory allocated
+            int64_t rss;        // peak resident set at the end, KB
+            int threads;        // planned by the thread budget, max
+            int os_threads;     // OS threads at the end, max
+            int64_t remote;     // KB on other NUMA nodes at the end, max
+        };
+
+        static bool enabled;
+
+        static void add (Stage const &);
+        static std::vector<Stage> stages ();
+        static void reset ();
+        static void dump_json (std::ostream &os, std::string const &title);
+        static void dump_csv (std::ostream &os);
+
+        // peak resident set size of the process in KB
+        static int64_t peak_rss ();
+        // start a new peak, where the kernel supports it (Linux >= 4.0)
+        static bool reset_peak_rss ();
+
+        class Scope {
+            char const *name;
+            Study const *study;
+            uint64_t n_slices;
+            int64_t bytes0;
+            std::unique_ptr<boost::timer::cpu_timer> timer;
+            Trace::Scope trace;     // stage event when tracing
+            Threads::Budget budget;
+        public:
+            // with a study, slices and image memory are counted from it
+            Scope (char const *name, Study const *study = nullptr);
+            ~Scope ();
+            void slices (uint64_t n) {
+                n_slices += n;
+            }
+        };
+    };
+
+    // total bytes of slice images held by a study
+    int64_t image_bytes (Study const &);
+}
@@ -0,0 +1,272 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <algorithm>
+#include "adsb2.h"
+
+namespace adsb2 {
+
+    // Binary report store layout.  All sections start at 8-byte aligned
+    // offsets, computed from the counts in the header.
+    //
+    //  ReportHeader
+    //  ReportStore::Entry  studies[n_studies]      sorted by study_id
+    //  int32_t             sax_id[n_slices]
+    //  int32_t             slice_id[n_slices]
+    //  cv::Rect            box[n_slices]
+    //  cv::Rect            polar_box[n_slices]
+    //  Meta                meta[n_slices]
+    //  float               data[n_slices][SL_SIZE]
+    //  uint64_t            path_off[n_slices + 1]  offsets into strings
+    //  char                strings[strings_size]
+    //
+    // Slices of a study are contiguous, in (sax, slice) order.
+    // The file is native endian and only portable between builds
+    // sharing the same Meta layout, which the header records.
+
+    static char const REPORT_MAGIC[8] = {'A', 'D', 'S', 'B', '2', 'R', 'P', 'T'};
+    static uint32_t const REPORT_VERSION = 1;
+
+    struct ReportHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t meta_size;     // sizeof(Meta)
+        uint32_t data_size;     // SL_SIZE
+        uint32_t n_studies;
+        uint64_t n_slices;
+        uint64_t strings_size;
+    };
+
+    struct ReportStore::Entry {
+        int32_t study_id;
+        int32_t n_sax;          // StudyReport::size(), may have empty sax
+        uint64_t begin;         // slice range
+        uint64_t end;
+    };
+
+    static inline size_t align8 (size_t off) {
+        return (off + 7) & ~size_t(7);
+    }
+
+    struct ReportLayout {
+        size_t studies, sax_id, slice_id, box, polar_box, meta, data, path_off, strings, total;
+        ReportLayout (size_t n_studies, size_t n_slices, size_t strings_size) {
+            studies = align8(sizeof(ReportHeader));
+            sax_id = align8(studies + n_studies * sizeof(ReportStore::Entry));
+            slice_id = align8(sax_id + n_slices * sizeof(int32_t));
+            box = align8(slice_id + n_slices * sizeof(int32_t));
+            polar_box = align8(box + n_slices * sizeof(cv::Rect));
+            meta = align8(polar_box + n_slices * sizeof(cv::Rect));
+            data = align8(meta + n_slices * sizeof(Meta));
+            path_off = align8(data + n_slices * SL_SIZE * sizeof(float));
+            strings = align8(path_off + (n_slices + 1) * sizeof(uint64_t));
+            total = strings + strings_size;
+        }
+    };
+
+    bool ReportStore::probe (fs::path const &path) {
+        fs::ifstream is(path, std::ios::binary);
+        if (!is) return false;
+        char magic[sizeof(REPORT_MAGIC)];
+        is.read(magic, sizeof(magic));
+        if (!is) return false;
+        return memcmp(magic, REPORT_MAGIC, sizeof(magic)) == 0;
+    }
+
+    template <typename T>
+    static void write_section (std::ostream &os, size_t *off, size_t target,
+                               T const *v, size_t n) {
+        CHECK(*off <= target);
+        while (*off < target) {
+            os.put(0);
+            ++*off;
+        }
+        if (n) {
+            os.write(reinterpret_cast<char const *>(v), sizeof(T) * n);
+            *off += sizeof(T) * n;
+        }
+    }
+
+    void ReportStore::save (fs::path const &path, vector<StudyReport const *> const &reports) {
+        vector<std::pair<int, StudyReport const *>> todo;
+        for (auto r: reports) {
+            for (auto const &ss: *r) {
+                if (ss.size()) {
+                    todo.emplace_back(ss.front().study_id, r);
+                    break;
+                }
+            }
+        }
+        std::sort(todo.begin(), todo.end(),
+                [](std::pair<int, StudyReport const *> const &a,
+                   std::pair<int, StudyReport const *> const &b) {
+                    return a.first < b.first;
+                });
+        vector<Entry> studies;
+        vector<int32_t> sax_id, slice_id;
+        vector<cv::Rect> box, polar_box;
+        vector<Meta> meta;
+        vector<float> data;
+        vector<uint64_t> path_off;
+        string strings;
+        for (auto const &p: todo) {
+            if (studies.size()) {
+                CHECK(studies.back().study_id != p.first) << "duplicate study " << p.first;
+            }
+            Entry e;
+            e.study_id = p.first;
+            e.n_sax = p.second->size();
+            e.begin = sax_id.size();
+            for (auto const &ss: *p.second) {
+                for (auto const &s: ss) {
+                    CHECK(s.study_id == e.study_id);
+                    CHECK(s.sax_id >= 0 && s.sax_id < e.n_sax);
+                    sax_id.push_back(s.sax_id);
+                    slice_id.push_back(s.slice_id);
+                    box.push_back(s.box);
+                    polar_box.push_back(s.polar_box);
+                    meta.push_back(s.meta);
+                    data.insert(data.end(), s.data.begin(), s.data.end());
+                    path_off.push_back(strings.size());
+                    strings += s.path.native();
+                }
+            }
+            e.end = sax_id.size();
+            studies.push_back(e);
+        }
+        path_off.push_back(strings.size());
+
+        ReportHeader header;
+        memcpy(header.magic, REPORT_MAGIC, sizeof(REPORT_MAGIC));
+        header.version = REPORT_VERSION;
+        header.meta_size = sizeof(Meta);
+        header.data_size = SL_SIZE;
+        header.n_studies = studies.size();
+        header.n_slices = sax_id.size();
+        header.strings_size = strings.size();
+
+        ReportLayout layout(studies.size(), sax_id.size(), strings.size());
+        fs::path tmp(path);
+        tmp += ".tmp";
+        {
+            fs::ofstream os(tmp, std::ios::binary);
+            CHECK(os) << "cannot write " << tmp;
+            size_t off = 0;
+            write_section(os, &off, 0, &header, 1);
+            write_section(os, &off, layout.studies, studies.data(), studies.size());
+            write_section(os, &off, layout.sax_id, sax_id.data(), sax_id.size());
+            write_section(os, &off, layout.slice_id, slice_id.data(), slice_id.size());
+            write_section(os, &off, layout.box, box.data(), box.size());
+            write_section(os, &off, layout.polar_box, polar_box.data(), polar_box.size());
+            write_section(os, &off, layout.meta, meta.data(), meta.size());
+            write_section(os, &off, layout.data, data.data(), data.size());
+            write_section(os, &off, layout.path_off, path_off.data(), path_off.size());
+            write_section(os, &off, layout.strings, strings.data(), strings.size());
+            CHECK(off == layout.total);
+            CHECK(os) << "error writing " << tmp;
+        }
+        // readers never see a partial store
+        fs::rename(tmp, path);
+    }
+
+    ReportStore::ReportStore (fs::path const &path)
+        : base(nullptr), length(0), n_studies(0) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        CHECK(fd >= 0) << "cannot open " << path;
+        struct stat st;
+        CHECK(fstat(fd, &st) == 0);
+        length = st.st_size;
+        CHECK(length >= sizeof(ReportHeader)) << "bad report store " << path;
+        void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        CHECK(p != MAP_FAILED) << "cannot mmap " << path;
+        base = reinterpret_cast<char const *>(p);
+
+        ReportHeader const *header = reinterpret_cast<ReportHeader const *>(base);
+        CHECK(memcmp(header->magic, REPORT_MAGIC, sizeof(REPORT_MAGIC)) == 0) << "bad report store " << path;
+        CHECK(header->version == REPORT_VERSION) << path << " version " << header->version;
+        CHECK(header->meta_size == sizeof(Meta)) << path << " written with different Meta layout";
+        CHECK(header->data_size == SL_SIZE) << path << " written with different SL_SIZE";
+        ReportLayout layout(header->n_studies, header->n_slices, header->strings_size);
+        CHECK(layout.total == length) << "truncated report store " << path;
+        n_studies = header->n_studies;
+        studies = reinterpret_cast<Entry const *>(base + layout.studies);
+        sax_id = reinterpret_cast<int32_t const *>(base + layout.sax_id);
+        slice_id = reinterpret_cast<int32_t const *>(base + layout.slice_id);
+        box = reinterpret_cast<cv::Rect const *>(base + layout.box);
+        polar_box = reinterpret_cast<cv::Rect const *>(base + layout.polar_box);
+        meta = reinterpret_cast<Meta const *>(base + layout.meta);
+        data = reinterpret_cast<float const *>(base + layout.data);
+        path_off = reinterpret_cast<uint64_t const *>(base + layout.path_off);
+        strings = base + layout.strings;
+    }
+
+    ReportStore::~ReportStore () {
+        if (base) {
+            munmap(const_cast<char *>(base), length);
+        }
+    }
+
+    int ReportStore::study_id (unsigned i) const {
+        CHECK(i < n_studies);
+        return studies[i].study_id;
+    }
+
+    void ReportStore::load_at (unsigned i, StudyReport *rep) const {
+        CHECK(i < n_studies);
+        Entry const &e = studies[i];
+        rep->clear();
+        rep->resize(e.n_sax);
+        for (uint64_t j = e.begin; j < e.end; ++j) {
+            SliceReport s;
+            s.study_id = e.study_id;
+            s.sax_id = sax_id[j];
+            s.slice_id = slice_id[j];
+            s.path = fs::path(string(strings + path_off[j], strings + path_off[j + 1]));
+            s.box = box[j];
+            s.polar_box = polar_box[j];
+            s.meta = meta[j];
+            std::copy(data + j * SL_SIZE, data + (j + 1) * SL_SIZE, s.data.begin());
+            rep->at(s.sax_id).push_back(s);
+        }
+    }
+
+    bool ReportStore::load (int study, StudyReport *rep) const {
+        Entry const *end = studies + n_studies;
+        Entry const *it = std::lower_bound(studies, end, study,
+                [](Entry const &e, int id) {
+                    return e.study_id < id;
+                });
+        if (it == end || it->study_id != study) {
+            rep->clear();
+            return false;
+        }
+        load_at(it - studies, rep);
+        return true;
+    }
+
+    ReportLoader::ReportLoader (fs::path const &root_): root(root_) {
+        if (fs::is_regular_file(root) && ReportStore::probe(root)) {
+            store.reset(new ReportStore(root));
+        }
+    }
+
+    fs::path ReportLoader::describe (int study) const {
+        if (store) {
+            return root / fs::path(lexical_cast<string>(study));
+        }
+        return root / fs::path(lexical_cast<string>(study)) / fs::path("report.txt");
+    }
+
+    bool ReportLoader::load (int study, StudyReport *rep) const {
+        if (store) {
+            return store->load(study, rep) && rep->size();
+        }
+        StudyReport x(describe(study));
+        rep->swap(x);
+        return rep->size();
+    }
+}
+
@@ -0,0 +1,407 @@
+#include <cmath>
+#include <cstring>
+#include <atomic>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ADSB2_SIMD_X86 1
+#endif
+#include "adsb2-simd.h"
+
+namespace adsb2 {
+    namespace simd {
+
+        namespace {
+
+            struct Kernels {
+                void (*affine_round_clamp) (float *, size_t, float, float, float, float, float);
+                void (*masked_sum) (float const *, uint8_t const *, size_t, float *, uint64_t *);
+                bool (*extent_f32) (float const *, size_t, size_t *, size_t *);
+                bool (*extent_u8) (uint8_t const *, size_t, size_t *, size_t *);
+                float (*project_row) (float const *, size_t, float *);
+            };
+
+            // scalar versions, also used for the tails of vector loops
+
+            inline float affine1 (float x, float sub, float mul, float div, float lo, float hi) {
+                x = std::round((x - sub) * mul / div);
+                if (x < lo) x = lo;
+                else if (x > hi) x = hi;
+                return x;
+            }
+
+            void affine_round_clamp_scalar (float *v, size_t n, float sub, float mul, float div, float lo, float hi) {
+                for (size_t i = 0; i < n; ++i) {
+                    v[i] = affine1(v[i], sub, mul, div, lo, hi);
+                }
+            }
+
+            void masked_sum_scalar (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum) {
+                float s = 0;
+                uint64_t m = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    if (mask[i]) s += v[i];
+                    m += mask[i];
+                }
+                *vsum = s;
+                *msum = m;
+            }
+
+            template <typename T>
+            bool extent_scalar (T const *v, size_t n, size_t *first, size_t *last) {
+                size_t b = 0;
+                while (b < n && !v[b]) ++b;
+                if (b >= n) return false;
+                size_t e = n - 1;
+                while (!v[e]) --e;
+                *first = b;
+                *last = e;
+                return true;
+            }
+
+            float project_row_scalar (float const *v, size_t n, float *X) {
+                float s = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    X[i] += v[i];
+                    s += v[i];
+                }
+                return s;
+            }
+
+            // vector extent search: block i (of W elements) has the
+            // non-zero bit mask returned by nz(i)
+            template <unsigned W, typename T, typename NZ>
+            __attribute__((always_inline)) inline bool extent_blocks (T const *v, size_t n, size_t *first, size_t *last, NZ nz) {
+                size_t nb = n / W;
+                size_t b = 0;
+                for (; b < nb; ++b) {
+                    uint64_t m = nz(b * W);
+                    if (m) {
+                        *first = b * W + __builtin_ctzll(m);
+                        break;
+                    }
+                }
+                if (b >= nb) {
+                    // none in the blocks, the tail is all there is
+                    size_t f, l;
+                    if (!extent_scalar(v + nb * W, n - nb * W, &f, &l)) return false;
+                    *first = nb * W + f;
+                    *last = nb * W + l;
+                    return true;
+                }
+                size_t f, l;
+                if (extent_scalar(v + nb * W, n - nb * W, &f, &l)) {
+                    *last = nb * W + l;
+                    return true;
+                }
+                for (size_t e = nb; e > b; --e) {
+                    uint64_t m = nz((e - 1) * W);
+                    if (m) {
+                        *last = (e - 1) * W + 63 - __builtin_clzll(m);
+                        return true;
+                    }
+                }
+                *last = *first;     // not reached, block b has one
+                return true;
+            }
+
+#ifdef ADSB2_SIMD_X86
+            // round half away from zero as std::round: add the float
+            // just below 0.5 with the sign of x and truncate
+#define ADSB2_SIMD_HALF 0.49999997f
+
+            // Each level is compiled for its instruction set, so that
+            // extent_blocks and the mask lambdas inline into its kernels.
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+            inline float hsum128 (__m128 v) {
+                v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+                v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+                return _mm_cvtss_f32(v);
+            }
+
+            void affine_round_clamp_sse (float *v, size_t n, float sub, float mul, float div, float lo, float hi) {
+                __m128 vsub = _mm_set1_ps(sub), vmul = _mm_set1_ps(mul), vdiv = _mm_set1_ps(div);
+                __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+                __m128 half = _mm_set1_ps(ADSB2_SIMD_HALF), sign = _mm_set1_ps(-0.0f);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 x = _mm_div_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), vsub), vmul), vdiv);
+                    x = _mm_add_ps(x, _mm_or_ps(half, _mm_and_ps(x, sign)));
+                    x = _mm_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                    // max/min return the second operand on NaN and
+                    // equal values, which keeps NaN and -0 as scalar
+                    x = _mm_min_ps(vhi, _mm_max_ps(vlo, x));
+                    _mm_storeu_ps(v + i, x);
+                }
+                affine_round_clamp_scalar(v + i, n - i, sub, mul, div, lo, hi);
+            }
+
+            void masked_sum_sse (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum) {
+                __m128 s = _mm_setzero_ps();
+                __m128i m = _mm_setzero_si128(), zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    int32_t bytes;
+                    memcpy(&bytes, mask + i, 4);
+                    __m128i k = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+                    __m128 on = _mm_castsi128_ps(_mm_cmpgt_epi32(k, zero));
+                    s = _mm_add_ps(s, _mm_and_ps(on, _mm_loadu_ps(v + i)));
+                    m = _mm_add_epi32(m, k);
+                }
+                uint32_t ms[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(ms), m);
+                float ts;
+                uint64_t tm;
+                masked_sum_scalar(v + i, mask + i, n - i, &ts, &tm);
+                *vsum = hsum128(s) + ts;
+                *msum = uint64_t(ms[0]) + ms[1] + ms[2] + ms[3] + tm;
+            }
+
+            bool extent_f32_sse (float const *v, size_t n, size_t *first, size_t *last) {
+                __m128 zero = _mm_setzero_ps();
+                return extent_blocks<4>(v, n, first, last, [v, zero](size_t i) -> uint64_t {
+                    return _mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(v + i), zero));
+                });
+            }
+
+            bool extent_u8_sse (uint8_t const *v, size_t n, size_t *first, size_t *last) {
+                __m128i zero = _mm_setzero_si128();
+                return extent_blocks<16>(v, n, first, last, [v, zero](size_t i) -> uint64_t {
+                    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(v + i));
+                    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) & 0xFFFF;
+                });
+            }
+
+            float project_row_sse (float const *v, size_t n, float *X) {
+                __m128 s = _mm_setzero_ps();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 x = _mm_loadu_ps(v + i);
+                    _mm_storeu_ps(X + i, _mm_add_ps(_mm_loadu_ps(X + i), x));
+                    s = _mm_add_ps(s, x);
+                }
+                return hsum128(s) + project_row_scalar(v + i, n - i, X + i);
+            }
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+            inline float hsum256 (__m256 v) {
+                __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+                x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+                return _mm_cvtss_f32(x);
+            }
+
+            void affine_round_clamp_avx2 (float *v, size_t n, float sub, float mul, float div, float lo, float hi) {
+                __m256 vsub = _mm256_set1_ps(sub), vmul = _mm256_set1_ps(mul), vdiv = _mm256_set1_ps(div);
+                __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+                __m256 half = _mm256_set1_ps(ADSB2_SIMD_HALF), sign = _mm256_set1_ps(-0.0f);
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256 x = _mm256_div_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(v + i), vsub), vmul), vdiv);
+                    x = _mm256_add_ps(x, _mm256_or_ps(half, _mm256_and_ps(x, sign)));
+                    x = _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                    x = _mm256_min_ps(vhi, _mm256_max_ps(vlo, x));
+                    _mm256_storeu_ps(v + i, x);
+                }
+                affine_round_clamp_scalar(v + i, n - i, sub, mul, div, lo, hi);
+            }
+
+            void masked_sum_avx2 (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum) {
+                __m256 s = _mm256_setzero_ps();
+                __m256i m = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(mask + i)));
+                    __m256 on = _mm256_castsi256_ps(_mm256_cmpgt_epi32(k, zero));
+                    s = _mm256_add_ps(s, _mm256_and_ps(on, _mm256_loadu_ps(v + i)));
+                    m = _mm256_add_epi32(m, k);
+                }
+                uint32_t ms[8];
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(ms), m);
+                float ts;
+                uint64_t tm;
+                masked_sum_scalar(v + i, mask + i, n - i, &ts, &tm);
+                *vsum = hsum256(s) + ts;
+                for (uint32_t x: ms) tm += x;
+                *msum = tm;
+            }
+
+            bool extent_f32_avx2 (float const *v, size_t n, size_t *first, size_t *last) {
+                __m256 zero = _mm256_setzero_ps();
+                return extent_blocks<8>(v, n, first, last, [v, zero](size_t i) -> uint64_t {
+                    return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(v + i), zero, _CMP_NEQ_UQ));
+                });
+            }
+
+            bool extent_u8_avx2 (uint8_t const *v, size_t n, size_t *first, size_t *last) {
+                __m256i zero = _mm256_setzero_si256();
+                return extent_blocks<32>(v, n, first, last, [v, zero](size_t i) -> uint64_t {
+                    __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(v + i));
+                    return ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero)));
+                });
+            }
+
+            float project_row_avx2 (float const *v, size_t n, float *X) {
+                __m256 s = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256 x = _mm256_loadu_ps(v + i);
+                    _mm256_storeu_ps(X + i, _mm256_add_ps(_mm256_loadu_ps(X + i), x));
+                    s = _mm256_add_ps(s, x);
+                }
+                return hsum256(s) + project_row_scalar(v + i, n - i, X + i);
+            }
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+
+            void affine_round_clamp_avx512 (float *v, size_t n, float sub, float mul, float div, float lo, float hi) {
+                __m512 vsub = _mm512_set1_ps(sub), vmul = _mm512_set1_ps(mul), vdiv = _mm512_set1_ps(div);
+                __m512 vlo = _mm512_set1_ps(lo), vhi = _mm512_set1_ps(hi);
+                __m512i half = _mm512_castps_si512(_mm512_set1_ps(ADSB2_SIMD_HALF));
+                __m512i sign = _mm512_castps_si512(_mm512_set1_ps(-0.0f));
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m512 x = _mm512_div_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(v + i), vsub), vmul), vdiv);
+                    __m512i h = _mm512_or_si512(half, _mm512_and_si512(_mm512_castps_si512(x), sign));
+                    x = _mm512_add_ps(x, _mm512_castsi512_ps(h));
+                    x = _mm512_roundscale_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                    x = _mm512_min_ps(vhi, _mm512_max_ps(vlo, x));
+                    _mm512_storeu_ps(v + i, x);
+                }
+                affine_round_clamp_scalar(v + i, n - i, sub, mul, div, lo, hi);
+            }
+
+            void masked_sum_avx512 (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum) {
+                __m512 s = _mm512_setzero_ps();
+                __m512i m = _mm512_setzero_si512();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m512i k = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(mask + i)));
+                    s = _mm512_mask_add_ps(s, _mm512_test_epi32_mask(k, k), s, _mm512_loadu_ps(v + i));
+                    m = _mm512_add_epi32(m, k);
+                }
+                float ts;
+                uint64_t tm;
+                masked_sum_scalar(v + i, mask + i, n - i, &ts, &tm);
+                *vsum = _mm512_reduce_add_ps(s) + ts;
+                *msum = uint32_t(_mm512_reduce_add_epi32(m)) + tm;
+            }
+
+            bool extent_f32_avx512 (float const *v, size_t n, size_t *first, size_t *last) {
+                __m512 zero = _mm512_setzero_ps();
+                return extent_blocks<16>(v, n, first, last, [v, zero](size_t i) -> uint64_t {
+                    return _mm512_cmp_ps_mask(_mm512_loadu_ps(v + i), zero, _CMP_NEQ_UQ);
+                });
+            }
+
+            bool extent_u8_avx512 (uint8_t const *v, size_t n, size_t *first, size_t *last) {
+                return extent_blocks<64>(v, n, first, last, [v](size_t i) -> uint64_t {
+                    __m512i x = _mm512_loadu_si512(v + i);
+                    return _mm512_test_epi8_mask(x, x);
+                });
+            }
+
+            float project_row_avx512 (float const *v, size_t n, float *X) {
+                __m512 s = _mm512_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m512 x = _mm512_loadu_ps(v + i);
+                    _mm512_storeu_ps(X + i, _mm512_add_ps(_mm512_loadu_ps(X + i), x));
+                    s = _mm512_add_ps(s, x);
+                }
+                return _mm512_reduce_add_ps(s) + project_row_scalar(v + i, n - i, X + i);
+            }
+#pragma GCC pop_options
+#endif
+
+            Kernels const KERNELS[LEVELS] = {
+                {affine_round_clamp_scalar, masked_sum_scalar, extent_scalar<float>, extent_scalar<uint8_t>, project_row_scalar},
+#ifdef ADSB2_SIMD_X86
+                {affine_round_clamp_sse, masked_sum_sse, extent_f32_sse, extent_u8_sse, project_row_sse},
+                {affine_round_clamp_avx2, masked_sum_avx2, extent_f32_avx2, extent_u8_avx2, project_row_avx2},
+                {affine_round_clamp_avx512, masked_sum_avx512, extent_f32_avx512, extent_u8_avx512, project_row_avx512},
+#else
+                {affine_round_clamp_scalar, masked_sum_scalar, extent_scalar<float>, extent_scalar<uint8_t>, project_row_scalar},
+                {affine_round_clamp_scalar, masked_sum_scalar, extent_scalar<float>, extent_scalar<uint8_t>, project_row_scalar},
+                {affine_round_clamp_scalar, masked_sum_scalar, extent_scalar<float>, extent_scalar<uint8_t>, project_row_scalar},
+#endif
+            };
+
+            char const *NAMES[LEVELS] = {"scalar", "sse", "avx2", "avx512"};
+
+            std::atomic<int> current(-1);
+
+            inline Kernels const &kernels () {
+                int l = current.load(std::memory_order_relaxed);
+                if (l < 0) {
+                    l = detect();
+                    current.store(l, std::memory_order_relaxed);
+                }
+                return KERNELS[l];
+            }
+        }
+
+        Level detect () {
+#ifdef ADSB2_SIMD_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return AVX512;
+            if (__builtin_cpu_supports("avx2")) return AVX2;
+            if (__builtin_cpu_supports("sse4.1")) return SSE;
+#endif
+            return SCALAR;
+        }
+
+        Level level () {
+            kernels();
+            return Level(current.load(std::memory_order_relaxed));
+        }
+
+        Level set_level (Level l) {
+            Level best = detect();
+            if (l > best) l = best;
+            current.store(l, std::memory_order_relaxed);
+            return l;
+        }
+
+        char const *name (Level l) {
+            return NAMES[l];
+        }
+
+        int parse (char const *s) {
+            if (strcmp(s, "auto") == 0) return detect();
+            for (int l = 0; l < LEVELS; ++l) {
+                if (strcmp(s, NAMES[l]) == 0) return l;
+            }
+            return -1;
+        }
+
+        void affine_round_clamp (float *v, size_t n, float sub, float mul, float div, float lo, float hi) {
+            kernels().affine_round_clamp(v, n, sub, mul, div, lo, hi);
+        }
+
+        void masked_sum (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum) {
+            kernels().masked_sum(v, mask, n, vsum, msum);
+        }
+
+        bool nonzero_extent (float const *v, size_t n, size_t *first, size_t *last) {
+            return kernels().extent_f32(v, n, first, last);
+        }
+
+        bool nonzero_extent (uint8_t const *v, size_t n, size_t *first, size_t *last) {
+            return kernels().extent_u8(v, n, first, last);
+        }
+
+        float project_row (float const *v, size_t n, float *X) {
+            return kernels().project_row(v, n, X);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Elementwise kernels behind the loop helpers of adsb2-cv.h.
+// Each kernel has a scalar version, which is the reference, and
+// SSE4.1, AVX2 and AVX-512 versions on x86-64; the best one the cpu
+// supports is picked at the first call, or set by adsb2.simd.
+// Kernels work on one contiguous row.
+namespace adsb2 {
+    namespace simd {
+
+        enum Level {
+            SCALAR = 0,
+            SSE,        // SSE4.1
+            AVX2,
+            AVX512,     // AVX-512F and BW
+            LEVELS
+        };
+
+        // best level of this cpu
+        Level detect ();
+        Level level ();
+        // clamped to detect(), returns the level in effect
+        Level set_level (Level);
+        char const *name (Level);
+        // "auto" or a level name, -1 if unknown
+        int parse (char const *);
+
+        // v = min(max(round((v - sub) * mul / div), lo), hi), with the
+        // rounding of std::round; bit exact with the scalar version
+        void affine_round_clamp (float *v, size_t n, float sub, float mul, float div, float lo, float hi);
+
+        // sum of v where mask is not 0, and sum of mask
+        void masked_sum (float const *v, uint8_t const *mask, size_t n, float *vsum, uint64_t *msum);
+
+        // first and last index of non-zero elements, false if all are 0
+        bool nonzero_extent (float const *v, size_t n, size_t *first, size_t *last);
+        bool nonzero_extent (uint8_t const *v, size_t n, size_t *first, size_t *last);
+
+        // column projection X[i] += v[i], returns the row sum;
+        // X is exact, the sum is in a different order than scalar
+        float project_row (float const *v, size_t n, float *X);
+    }
+}
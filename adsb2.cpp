@@ -1,4 +1,6 @@
 #include <thread>
+#include <cstring>
+#include <iterator>
 #include <mutex>
 #include <unordered_map>
 #define BOOST_SPIRIT_THREADSAFE
@@ -20,10 +22,7 @@
 #include <snappystream.hpp>
 #include "adsb2.h"
 #include "adsb2-io.h"
-
-extern "C" {
-void    openblas_set_num_threads (int);    
-}
+#include "adsb2-parse.h"
 
 namespace adsb2 {
     char const *MetaBase::FIELDS[] = {
@@ -72,6 +71,9 @@ namespace adsb2 {
     int font_thickness = 1;
     cv::Mat polar_morph_kernel;
 
+    Config backend_config;  // adsb2.backend
+    int compact_storage = 0;
+
     void dicom_setup (char const *path, Config const &config);
     void GlobalInit (char const *path, Config const &config) {
         if (config.get<int>("adsb2.about", 0)) {
@@ -84,13 +86,23 @@ namespace adsb2 {
 #endif
         FLAGS_logtostderr = 1;
         FLAGS_minloglevel = config.get<int>("adsb2.log.level",1);
+        Profile::enabled = config.get<int>("adsb2.profile", 0) != 0;
+#ifdef ADSB2_TRACE
+        Trace::setup(config.get("adsb2.trace.path", ""), config.get<unsigned>("adsb2.trace.events", 65536));
+#endif
         home_dir = fs::path(path).parent_path();
         temp_dir = fs::path(config.get("adsb2.tmp_dir", "/tmp"));
         model_dir = fs::path(config.get("adsb2.models", (home_dir/fs::path("models")).native()));
+        backend_config = config.get_child("adsb2.backend", Config());
+        compact_storage = config.get<int>("adsb2.compact", 0);
+        raw_pack = config.get<int>("adsb2.pack", 1);
+        CHECK(compact_storage >= 0 && compact_storage <= 2) << "bad adsb2.compact " << compact_storage;
         google::InitGoogleLogging(path);
         dicom_setup(path, config);
-        //openblas_set_num_threads(config.get<int>("adsb2.threads.openblas", 1));
-        cv::setNumThreads(config.get<int>("adsb2.threads.opencv", 1));
+        Threads::setup(config);
+        int simd_level = simd::parse(config.get<string>("adsb2.simd", "auto").c_str());
+        CHECK(simd_level >= 0) << "bad adsb2.simd " << config.get<string>("adsb2.simd");
+        simd::set_level(simd::Level(simd_level));
         int baseline = 0;
         cv::Size fsz = cv::getTextSize("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ123456789", font_face, font_scale, font_thickness, &baseline);
         font_height = 14 * fsz.height / 10;
@@ -133,7 +145,7 @@ namespace adsb2 {
             std::pair<std::thread::id, string> key(std::this_thread::get_id(), name);
             auto it = insts.find(key);
             if (it == insts.end()) {
-                T *det = T::create(model_dir / fs::path(name));
+                T *det = T::create(name);
                 CHECK(det) << "failed to create detector " << name;
                 insts[key] = det;
                 return det;
@@ -144,6 +156,35 @@ namespace adsb2 {
         }
     };
 
+    template <typename T>
+    static unordered_map<string, typename Backends<T>::Factory> &backend_registry () {
+        static unordered_map<string, typename Backends<T>::Factory> registry;
+        return registry;
+    }
+
+    template <typename T>
+    void Backends<T>::add (string const &backend, Factory factory) {
+        auto &registry = backend_registry<T>();
+        CHECK(registry.count(backend) == 0) << kind() << " backend " << backend << " registered twice.";
+        registry[backend] = factory;
+    }
+
+    template <typename T>
+    T *Backends<T>::create (string const &name) {
+        string backend = backend_config.get(name, backend_config.get<string>(kind(), default_backend()));
+        auto &registry = backend_registry<T>();
+        auto it = registry.find(backend);
+        CHECK(it != registry.end()) << kind() << " backend " << backend << " not linked, needed by " << name;
+        return it->second(model_dir / fs::path(name), backend_config);
+    }
+
+    template <> char const *Backends<Detector>::kind () { return "detector"; }
+    template <> char const *Backends<Detector>::default_backend () { return "caffe"; }
+    template <> char const *Backends<Classifier>::kind () { return "classifier"; }
+    template <> char const *Backends<Classifier>::default_backend () { return "xgboost"; }
+    template class Backends<Detector>;
+    template class Backends<Classifier>;
+
     ModelManager<Detector> detector_manager;
     ModelManager<Classifier> classifier_manager;
 
@@ -155,6 +196,14 @@ namespace adsb2 {
         return classifier_manager.get(name);
     }
 
+    void Classifier::apply (unsigned n, unsigned dim, float const *ft, float *out) const {
+        vector<float> v(dim);
+        for (unsigned i = 0; i < n; ++i) {
+            std::copy(ft + i * dim, ft + (i + 1) * dim, v.begin());
+            out[i] = apply(v);
+        }
+    }
+
     fs::path temp_path (const fs::path& model) {
         return fs::unique_path(temp_dir / model);
     }
@@ -409,15 +458,63 @@ namespace adsb2 {
         }
     }
 
+    static bool mask_channel (int channel) {
+        return channel == IM_BFILTER;
+    }
+
+    bool compact_channel (int channel) {
+        return mask_channel(channel) || channel == IM_PROB
+            || channel == IM_POLAR_PROB || channel == IM_LABEL;
+    }
+
+    cv::Mat compact_image (int channel, cv::Mat in) {
+        if (compact_storage == 0 || !compact_channel(channel)) return in;
+        if (!in.data || in.type() != CV_32F) return in;
+        cv::Mat out;
+        if (mask_channel(channel)) {
+            in.convertTo(out, CV_8U);
+        }
+        else if (compact_storage == 1) {
+            in.convertTo(out, CV_16U, 65535.0);
+        }
+        else {
+            in.convertTo(out, CV_8U, 255.0);
+        }
+        return out;
+    }
+
+    cv::Mat widen_image (int channel, cv::Mat in) {
+        if (!in.data || in.type() == CV_32F || !compact_channel(channel)) return in;
+        cv::Mat out;
+        if (mask_channel(channel)) {
+            in.convertTo(out, CV_32F);
+        }
+        else if (in.depth() == CV_16U) {
+            in.convertTo(out, CV_32F, 1.0 / 65535);
+        }
+        else {
+            CHECK(in.depth() == CV_8U);
+            in.convertTo(out, CV_32F, 1.0 / 255);
+        }
+        return out;
+    }
+
     void Slice::save (std::ostream &os) const {
         int v = VERSION;
         io::write(os, v);
         io::write(os, id);
         io::write(os, path);
         io::write(os, meta);
+        // bit i set: images[i] is compact
+        int compact = 0;
         for (unsigned i = 0; i < IM_SIZE; ++i) {
-            io::write(os, images[i]);
+            cv::Mat m = compact_image(i, images[i]);
+            if (compact_channel(i) && m.data && m.type() != CV_32F) {
+                compact |= 1 << i;
+            }
+            io::write(os, m);
         }
+        io::write(os, compact);
         io::write(os, data);
         io::write(os, do_not_cook);
         io::write(os, line);
@@ -450,6 +547,15 @@ namespace adsb2 {
         for (unsigned i = 0; i < IM_SIZE; ++i) {
             io::read(is, &images[i]);
         }
+        if (v >= 3) {
+            int compact;
+            io::read(is, &compact);
+            for (unsigned i = 0; i < IM_SIZE; ++i) {
+                if (compact & (1 << i)) {
+                    images[i] = widen_image(i, images[i]);
+                }
+            }
+        }
         if (v == 1) {
             is.read(reinterpret_cast<char *>(&data[0]),
                     sizeof(data[0]) * (SL_SIZE -1));
@@ -580,7 +686,65 @@ namespace adsb2 {
     }
 #endif
 
+    // series i of a pack, IM_RAW frames point into the mapping
+    static void load_pack_series (RawPack const &pack, unsigned i, vector<Slice> *ss) {
+        ss->resize(pack.series_size(i));
+        for (unsigned j = 0; j < ss->size(); ++j) {
+            Slice &s = ss->at(j);
+            pack.frame(i, j, &s.path, &s.meta, &s.images[IM_RAW]);
+            s.data[SL_COHORT] = s.meta.cohort;
+        }
+    }
+
     Series::Series (fs::path const &path_, bool load, bool check, bool fix): path(path_) {
+        fs::path pack_path = RawPack::find(path.parent_path());
+        if (!pack_path.empty()) {
+            std::shared_ptr<RawPack const> p(new RawPack(pack_path));
+            for (unsigned i = 0; i < p->size(); ++i) {
+                if (p->series_path(i).filename() != path.filename()) continue;
+                pack = p;
+                load_pack_series(*pack, i, this);
+                if (load && check && !sanity_check(fix) && fix) {
+                    CHECK(sanity_check(false));
+                }
+                return;
+            }
+            LOG(WARNING) << "series " << path << " not in " << pack_path;
+        }
+        fs::path archive = find_study_archive(path.parent_path());
+        if (!archive.empty()) {
+            // only the members of this series are read
+            string name = path.filename().native();
+            auto mine = [&name](string const &m) {
+                return fs::path(m).parent_path().filename().native() == name;
+            };
+            vector<std::pair<string, string>> members;
+            read_study_archive(archive, &members, [&mine, load](string const &m) {
+                return load && mine(m);
+            });
+            vector<string const *> data;
+            for (auto const &m: members) {
+                if (!mine(m.first)) continue;
+                emplace_back();
+                back().path = archive / fs::path(m.first);
+                data.push_back(&m.second);
+            }
+            CHECK(size()) << "no " << name << "/*.dcm in " << archive;
+            if (load) {
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
+                for (unsigned i = 0; i < size(); ++i) {
+                    at(i).load_raw(*data[i]);
+                }
+                for (auto const &s: *this) {
+                    CHECK(s.meta.spacing == front().meta.spacing);
+                    CHECK(s.images[IM_IMAGE].size() == front().images[IM_IMAGE].size());
+                }
+                if (check && !sanity_check(fix) && fix) {
+                    CHECK(sanity_check(false));
+                }
+            }
+            return;
+        }
         // enumerate DCM files
         vector<fs::path> paths;
         fs::directory_iterator end_itr;
@@ -835,6 +999,64 @@ namespace adsb2 {
 
     void Study::load_raw (fs::path const &path_, bool load, bool check, bool fix) {
         path = path_;
+        fs::path pack_path = RawPack::find(path);
+        if (!pack_path.empty()) {
+            // frames are there anyway, so they are filled even if !load
+            pack.reset(new RawPack(pack_path));
+            for (unsigned i = 0; i < pack->size(); ++i) {
+                emplace_back();
+                back().path = pack->series_path(i);
+                load_pack_series(*pack, i, &back());
+            }
+            if (load && check && !sanity_check(fix) && fix) {
+                CHECK(sanity_check(false));
+            }
+            return;
+        }
+        fs::path archive = find_study_archive(path);
+        if (!archive.empty()) {
+            vector<std::pair<string, string>> members;
+            // without load only the first member read is kept and
+            // decoded, e.g. for the study meta; the others are names
+            bool first = true;
+            read_study_archive(archive, &members, [load, &first](string const &) {
+                bool want = load || first;
+                first = false;
+                return want;
+            });
+            CHECK(members.size()) << "no sax_*/*.dcm in " << archive;
+            // members are sorted, each series is a contiguous range
+            fs::path dir;
+            for (auto const &m: members) {
+                fs::path p(m.first);
+                if (empty() || p.parent_path() != dir) {
+                    dir = p.parent_path();
+                    emplace_back();
+                    back().path = archive / dir;
+                }
+                back().emplace_back();
+                back().back().path = archive / p;
+            }
+            vector<Slice *> slices;
+            pool(&slices);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
+            for (unsigned i = 0; i < slices.size(); ++i) {
+                if (load || members[i].second.size()) {
+                    slices[i]->load_raw(members[i].second);
+                }
+            }
+            if (!load) return;
+            for (auto const &ss: *this) {
+                for (auto const &s: ss) {
+                    CHECK(s.meta.spacing == ss.front().meta.spacing);
+                    CHECK(s.images[IM_IMAGE].size() == ss.front().images[IM_IMAGE].size());
+                }
+            }
+            if (check && !sanity_check(fix) && fix) {
+                CHECK(sanity_check(false));
+            }
+            return;
+        }
         // enumerate DCM files
         vector<fs::path> paths;
         fs::directory_iterator end_itr;
@@ -856,7 +1078,7 @@ namespace adsb2 {
         for (auto const &sax: paths) {
             emplace_back(sax, load, false, false);    // do not fix for now
         }
-        if (load && !sanity_check(fix) && fix) {
+        if (load && check && !sanity_check(fix) && fix) {
             CHECK(sanity_check(false));
         }
     }
@@ -909,6 +1131,54 @@ namespace adsb2 {
         load(isnstrm);
     }
 
+    void ImagePlan::add (string const &name, std::initializer_list<int> uses, std::initializer_list<int> makes) {
+        Stage st;
+        st.name = name;
+        for (int i: uses) st.uses.set(i);
+        for (int i: makes) st.makes.set(i);
+        stages.push_back(st);
+    }
+
+    void ImagePlan::keep (std::initializer_list<int> images, bool extra) {
+        for (int i: images) kept.set(i);
+        keep_extra = keep_extra || extra;
+    }
+
+    void ImagePlan::keep_all () {
+        kept.set();
+        keep_extra = true;
+    }
+
+    std::bitset<IM_SIZE> ImagePlan::uses_after (string const &stage) const {
+        unsigned i = 0;
+        while (i < stages.size() && stages[i].name != stage) ++i;
+        CHECK(i < stages.size()) << "stage " << stage << " not in plan.";
+        std::bitset<IM_SIZE> r;
+        for (++i; i < stages.size(); ++i) {
+            r |= stages[i].uses;
+        }
+        return r;
+    }
+
+    std::bitset<IM_SIZE> ImagePlan::live (string const &stage) const {
+        return kept | uses_after(stage);
+    }
+
+    void ImagePlan::release (string const &stage, Study *study) const {
+        std::bitset<IM_SIZE> l = live(stage);
+        // only kept for output, no more float math
+        std::bitset<IM_SIZE> c = l & ~uses_after(stage);
+        for (auto &ss: *study) {
+            for (auto &s: ss) {
+                for (unsigned i = 0; i < IM_SIZE; ++i) {
+                    if (!l[i]) s.images[i].release();
+                    else if (c[i]) s.images[i] = compact_image(i, s.images[i]);
+                }
+                if (!keep_extra) s._extra.release();
+            }
+        }
+    }
+
 
     static constexpr float LOCATION_GAP_EPSILON = 0.01;
     static inline bool operator < (Series const &s1, Series const &s2) {
@@ -1148,11 +1418,15 @@ namespace adsb2 {
         vector<float> cmap;
         getColorMap(*series, &cmap, color_bins, &lb, &ub);
         */
-        getColorBounds(*series, &lb, &ub);
-#pragma omp parallel for schedule(dynamic, 1)
+        {
+            ADSB2_TRACE_SCOPE("getColorBounds");
+            getColorBounds(*series, &lb, &ub);
+        }
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
         for (unsigned i = 0; i < series->size(); ++i) {
             auto &s = series->at(i);
             if (s.do_not_cook) continue;
+            ADSB2_TRACE_SCOPE("cook", s.id);
             s.data[SL_COLOR_LB] = lb;
             s.data[SL_COLOR_UB] = ub;
             s.images[IM_RAW].convertTo(s.images[IM_IMAGE], CV_32F);
@@ -1171,6 +1445,7 @@ namespace adsb2 {
                     s.anno->scale(&s, scale);
                 }
             }
+            ADSB2_TRACE_SCOPE("cook:critical");
 #pragma omp critical
             s.images[IM_VAR] = vimage;
         }
@@ -1245,7 +1520,7 @@ namespace adsb2 {
         for (auto &p: dirs) {
             todo.emplace_back(fs::path(p.first), std::move(p.second));
         }
-#pragma omp parallel for
+#pragma omp parallel for num_threads(Threads::team())
         for (unsigned ii = 0; ii < todo.size(); ++ii) {
             fs::path dir = root / fs::path(todo[ii].first);
             Series stack(dir);
@@ -1289,13 +1564,8 @@ namespace adsb2 {
         float total = 0;
         CHECK(image.type() == CV_32F);
         for (int y = 0; y < image.rows; ++y) {
-            float const *row = image.ptr<float const>(y);
-            for (int x = 0; x < image.cols; ++x) {
-                float v = row[x];
-                X[x] += v;
-                Y[y] += v;
-                total += v;
-            }
+            Y[y] = simd::project_row(image.ptr<float const>(y), image.cols, X.data());
+            total += Y[y];
         }
         pX->swap(X);
         pY->swap(Y);
@@ -1318,58 +1588,87 @@ namespace adsb2 {
         }
     }
 
-    float Eval::crps (float v, vector<float> const &x) {
-        CHECK(x.size() == VALUES);
+    float Eval::crps (float v, float const *x) {
+        // i < v: target CDF is 0, otherwise 1
+        unsigned k = 0;
+        if (v > 0) {
+            k = std::min<unsigned>(VALUES, unsigned(std::ceil(v)));
+        }
         float sum = 0;
-        unsigned i = 0;
-        for (; i < v; ++i) {
-            float s = x[i];
+        int bad = !(x[0] >= 0) | !(x[VALUES-1] <= 1);
+        // monotonicity with the end points bounds x within [0, 1];
+        // the negated compare also catches NaN
+#pragma omp simd reduction(+:sum)
+        for (unsigned i = 0; i < VALUES; ++i) {
+            float s = x[i] - (i < k ? 0.0f : 1.0f);
             sum += s * s;
         }
-        for (; i < VALUES; ++i) {
-            float s = 1.0 - x[i];
-            sum += s * s;
+#pragma omp simd reduction(|:bad)
+        for (unsigned i = 1; i < VALUES; ++i) {
+            bad |= !(x[i] >= x[i-1]);
         }
-        for (unsigned i = 0; i < VALUES; ++i) {
-            CHECK(x[i] >= 0) << x[i];
-            CHECK(x[i] <= 1) << x[i];
-            if (i > 0) CHECK(x[i] >= x[i-1]);
+        if (bad) {  // slow path, for the error message
+            for (unsigned i = 0; i < VALUES; ++i) {
+                CHECK(x[i] >= 0) << x[i];
+                CHECK(x[i] <= 1) << x[i];
+                if (i > 0) CHECK(x[i] >= x[i-1]) << i << ": " << x[i-1] << ' ' << x[i];
+            }
         }
-        /*
-        CHECK(x.front() == 0);
-        CHECK(x.back() == 1);
-        */
         return sum/VALUES;
     }
 
+    float Eval::crps (float v, vector<float> const &x) {
+        CHECK(x.size() == VALUES);
+        return crps(v, &x[0]);
+    }
+
     float Eval::score (fs::path const &path, vector<std::pair<string, float>> *s) {
-        fs::ifstream is(path);
-        string line;
-        getline(is, line);
+        // the whole file is parsed in place, no per-line allocation
+        string buf;
+        {
+            fs::ifstream is(path, std::ios::binary);
+            CHECK(is) << "cannot open " << path;
+            buf.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+        }
+        char const *p = buf.data();
+        char const *end = p + buf.size();
+        p = std::find(p, end, '\n');   // skip header
         float sum = 0;
         s->clear();
-        while (getline(is, line)) {
-            using namespace boost::algorithm;
-            vector<string> ss;
-            split(ss, line, is_any_of(",_"), token_compress_on);
-            CHECK(ss.size() == VALUES + 2);
-            string name = ss[0] + "_" + ss[1];
-            int n = lexical_cast<int>(ss[0]);
+        array<float, VALUES> x;
+        for (;;) {
+            p = parse::skip_space(p, end);
+            if (p >= end) break;
+            // <id>_<Systole|Diastole>,v0,...,v599
+            char const *line = p;
+            int n;
+            p = parse::parse_int(p, end, &n);
+            CHECK(p && p < end && *p == '_') << "bad line: " << string(line, std::find(line, end, '\n'));
+            char const *tag = ++p;
+            p = std::find(p, end, ',');
+            CHECK(p < end) << "bad line: " << string(line, p);
+            string name(line, p);
+            size_t tag_len = p - tag;
             int m;
-            if (ss[1] == "Systole") {
+            if (tag_len == 7 && memcmp(tag, "Systole", 7) == 0) {
                 m = 0;
             }
-            else if (ss[1] == "Diastole") {
+            else if (tag_len == 8 && memcmp(tag, "Diastole", 8) == 0) {
                 m = 1;
             }
-            else CHECK(0);
-            float v = get(n,m);
-            if (v < 0) LOG(ERROR) << "Cannot find training data for " << name;
-            vector<float> x;
+            else CHECK(0) << "bad line: " << name;
             for (unsigned i = 0; i < VALUES; ++i) {
-                x.push_back(lexical_cast<float>(ss[2 + i]));
+                CHECK(p < end && *p == ',') << "not enough values: " << name;
+                p = parse::parse_float(p + 1, end, &x[i]);
+                CHECK(p) << "bad value: " << name << " " << i;
+            }
+            while (p < end && *p != '\n') {
+                CHECK(parse::is_space(*p)) << "too many values: " << name;
+                ++p;
             }
-            float score = crps(v, x);
+            float v = get(n,m);
+            if (v < 0) LOG(ERROR) << "Cannot find training data for " << name;
+            float score = crps(v, &x[0]);
             s->push_back(std::make_pair(name, score));
             sum += score;
         }
@@ -1447,10 +1746,11 @@ namespace adsb2 {
         boost::progress_display progress(slices.size(), std::cerr);
 //#define CPU_ONLY 1
 #ifdef CPU_ONLY
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
         for (unsigned i = 0; i < slices.size(); ++i) {
             cv::Mat from = slices[i]->images[FROM];
             if (!from.data) continue;
+            ADSB2_TRACE_SCOPE("detect", slices[i]->id);
             from = virtical_extend(from, vext);
             cv::Mat to;
             Detector *det = Detector::get(name);
@@ -1461,6 +1761,7 @@ namespace adsb2 {
             if (scale != 1.0) {
                 slices[i]->images[TO] *= scale;
             }
+            ADSB2_TRACE_SCOPE("detect:progress");
 #pragma omp critical
             ++progress;
         }
@@ -1482,6 +1783,7 @@ namespace adsb2 {
                 ++i;
             }
             vector<cv::Mat> tmp;
+            ADSB2_TRACE_SCOPE("detect:batch", input.size());
             det->apply(input, &tmp);
             CHECK(tmp.size() == input.size());
             for (unsigned j = 0; j < input.size(); ++j) {
@@ -1568,6 +1870,14 @@ namespace adsb2 {
     }
 
     StudyReport::StudyReport (fs::path const &path) {
+        if (ReportStore::probe(path)) {
+            ReportStore store(path);
+            CHECK(store.size() <= 1) << path << " holds " << store.size() << " studies, use ReportLoader.";
+            if (store.size()) {
+                store.load_at(0, this);
+            }
+            return;
+        }
         fs::ifstream is(path);
         if (!is) return;
         string line;
@@ -1598,6 +1908,15 @@ namespace adsb2 {
     }
 
     StudyReport::StudyReport (Study const &sss) {
+        int study_id = -1;
+        if (sss.size() && sss.front().size()) {
+            try {
+                study_id = path_to_study_id(sss.front().front().path);
+            }
+            catch (boost::bad_lexical_cast const &) {
+                LOG(WARNING) << "cannot find study id in " << sss.front().front().path;
+            }
+        }
         resize(sss.size());
         for (unsigned i = 0; i < sss.size(); ++i) {
             auto const &from = sss[i];
@@ -1606,6 +1925,7 @@ namespace adsb2 {
             for (unsigned j = 0; j < from.size(); ++j) {
                 auto const &slice = from[j];
                 auto &rep = to[j];
+                rep.study_id = study_id;
                 rep.sax_id = i;
                 rep.slice_id = j;
                 rep.path = slice.path;
@@ -1617,7 +1937,7 @@ namespace adsb2 {
         }
     }
 
-    void StudyReport::dump (std::ostream &os) {
+    void StudyReport::dump (std::ostream &os) const {
         for (auto const &ss: *this) {
             for (auto const &s: ss) {
                 os << s.path.native()
@@ -1647,25 +1967,86 @@ namespace adsb2 {
         }
     }
 
-    void NaiveGaussianAcc (float v, float scale, vector<float> *s) {
-        s->resize(Eval::VALUES);
-        float sum = 0;
+    void GaussianCDF (float mu, float sigma, float *cdf) {
+        // exp(-0.5((i-mu)/sigma)^2) by recurrence, outward from the bin
+        // nearest to mu which is fixed to 1: the ratio between
+        // neighboring bins is itself geometric with factor q.
+        // Only 3 exp calls, and no underflow to 0/0 when mu is far out.
+        double s2 = double(sigma) * sigma;
+        int i0 = std::min<int>(Eval::VALUES - 1, std::max<int>(0, std::lround(mu)));
+        double q = std::exp(-1.0 / s2);
+        double d = i0 - double(mu);
+        double g[Eval::VALUES];
+        g[i0] = 1;
+        double r = std::exp(-(2 * d + 1) / (2 * s2));
+        for (unsigned i = i0 + 1; i < Eval::VALUES; ++i) {
+            g[i] = g[i-1] * r;
+            r *= q;
+        }
+        double l = std::exp((2 * d - 1) / (2 * s2));
+        for (int i = i0 - 1; i >= 0; --i) {
+            g[i] = g[i+1] * l;
+            l *= q;
+        }
+        double acc = 0;
         for (unsigned i = 0; i < Eval::VALUES; ++i) {
-            float x = (float(i) - v) / scale;
-            x = exp(-0.5 * x * x);
-            s->at(i) = x;
-            sum += x;
+            acc += g[i];
+            g[i] = acc;
         }
-        float acc = 0;
-        for (auto &v: *s) {
-            acc += v;
-            v = acc / sum;
+        for (unsigned i = 0; i < Eval::VALUES; ++i) {
+            cdf[i] = float(g[i] / acc);
+        }
+    }
+
+    // standard normal CDF tabulated on [-PHI_RANGE, PHI_RANGE],
+    // linear interpolation error < 1e-6
+    static constexpr int PHI_RANGE = 8;
+    static constexpr int PHI_STEPS = 256;   // per unit
+    struct PhiTable: public vector<float> {
+        PhiTable (): vector<float>(2 * PHI_RANGE * PHI_STEPS + 2) {
+            for (unsigned i = 0; i < size(); ++i) {
+                double z = double(i) / PHI_STEPS - PHI_RANGE;
+                at(i) = 0.5 * std::erfc(-z / M_SQRT2);
+            }
+        }
+    };
+
+    void NormalCDF (float mu, float sigma, float *cdf) {
+        CHECK(std::isfinite(mu) && sigma > 0) << "bad normal mu=" << mu << " sigma=" << sigma;
+        static PhiTable const table;
+        float const *t = &table[0];
+        float inv = 1.0f / sigma;
+        float const hi = 2 * PHI_RANGE * PHI_STEPS;
+#pragma omp simd
+        for (unsigned i = 0; i < Eval::VALUES; ++i) {
+            float z = (float(i) - mu) * inv;
+            // 0 * inf is NaN when sigma is denormal, NaN goes to bin 0
+            float x = (z + PHI_RANGE) * PHI_STEPS;
+            x = (x > 0) ? std::min(x, hi) : 0.0f;
+            int k = int(x);
+            float w = x - k;
+            cdf[i] = t[k] + w * (t[k+1] - t[k]);
+        }
+    }
+
+    void GaussianCDF (unsigned n, float const *mu, float const *sigma, float *cdf) {
+#pragma omp parallel for if (n > 64) num_threads(Threads::team())
+        for (unsigned i = 0; i < n; ++i) {
+            GaussianCDF(mu[i], sigma[i], cdf + size_t(i) * Eval::VALUES);
+        }
+    }
+
+    void NormalCDF (unsigned n, float const *mu, float const *sigma, float *cdf) {
+#pragma omp parallel for if (n > 64) num_threads(Threads::team())
+        for (unsigned i = 0; i < n; ++i) {
+            NormalCDF(mu[i], sigma[i], cdf + size_t(i) * Eval::VALUES);
         }
     }
 
     void GaussianAcc::apply (float v, float scale,
                              vector<float> *ps) const {
-        NaiveGaussianAcc(v, scale, ps);
+        ps->resize(Eval::VALUES);
+        GaussianCDF(v, scale, &ps->at(0));
 #if 0
         if (extend < 0) {
             return;
@@ -1753,11 +2134,26 @@ namespace adsb2 {
         */
     }
 
+    // splitmix64 finalizer
+    static inline uint64_t mix64 (uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    Sampler::Engine Sampler::stream (unsigned replica, unsigned id) const {
+        uint64_t k = mix64(seed + 0x9e3779b97f4a7c15ULL);
+        k = mix64(k ^ ((uint64_t(replica) << 32) | id));
+        std::seed_seq seq{uint32_t(k), uint32_t(k >> 32)};
+        return Engine(seq);
+    }
+
     bool Sampler::polar (cv::Mat from_image,
                       cv::Mat from_label,
                       cv::Mat *to_image,
                       cv::Mat *to_label,
-                      bool) {
+                      Engine &e,
+                      bool) const {
         cv::Rect box;
         cv::Mat shrink;
         cv::erode(from_label, shrink, polar_kernel);
@@ -1770,17 +2166,13 @@ namespace adsb2 {
         float R = std::min(box.width, box.height)/2;
         bool flip = false;
         {
-            float dx, dy, dr;
-#pragma omp critical
-            {
-                float cr = polar_C(e) * R;  // center perturb
-                float phi = polar_phi(e);
-                flip = ((e() % 2) == 1);
-                color = delta_color(e);
-                dr = polar_R(e);
-                dx = cr * std::cos(phi);
-                dy = cr * std::sin(phi);
-            }
+            float cr = draw(polar_C, e) * R;  // center perturb
+            float phi = draw(polar_phi, e);
+            flip = ((e() % 2) == 1);
+            color = draw(delta_color, e);
+            float dr = draw(polar_R, e);
+            float dx = cr * std::cos(phi);
+            float dy = cr * std::sin(phi);
             cv::Point p(std::round(C.x + dx), std::round(C.y + dy));
             uint8_t v = shrink.at<uint8_t>(p);
             if (v == 0) return false;
@@ -1,5 +1,9 @@
 #pragma once
 #include <array>
+#include <bitset>
+#include <functional>
+#include <memory>
+#include <cstdint>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -21,6 +25,7 @@
 #include <glog/logging.h>
 #include "adsb2-cv.h"
 #include "adsb2-io.h"
+#include "adsb2-profile.h"
 
 namespace adsb2 {
 
@@ -80,7 +85,10 @@ namespace adsb2 {
         float width, height;
         int cohort;
         //string cohort;
-        MetaBase (): spacing(-1), raw_spacing(-1) {
+        // every field is initialized, Meta is written to binary stores as is
+        MetaBase (): trigger_time(0), spacing(-1), raw_spacing(-1),
+            slice_location(0), z(0), placeholder(), PercentPhaseFieldOfView(0),
+            width(0), height(0), cohort(0) {
         }
         static char const *FIELDS[];
     };
@@ -93,6 +101,22 @@ namespace adsb2 {
     void GlobalInit (char const *path, Config const &config);
 
     cv::Mat load_dicom (fs::path const &, Meta *);
+    // from a DICOM file in memory, path is only for messages
+    cv::Mat load_dicom (string const &data, fs::path const &path, Meta *);
+    // archive to load a study from: the path itself if it is a .tar,
+    // .tar.gz, .tgz or .zip file, or <path>.<ext> if path does not exist;
+    // empty if none
+    fs::path find_study_archive (fs::path const &path);
+    // the sax_*/*.dcm members of a study archive as (name, data),
+    // sorted as the directory walk would; zip members are inflated
+    // in parallel, tar is read in one streaming pass.  If want is given,
+    // it is called on each name in archive order, and members it rejects
+    // are listed with empty data.
+    void read_study_archive (fs::path const &path, vector<std::pair<string, string>> *members,
+                             std::function<bool (string const &)> const &want = nullptr);
+    // writes a 16-bit monochrome DICOM with the tags load_dicom reads;
+    // used to generate synthetic studies
+    void save_dicom (fs::path const &, cv::Mat raw, Meta const &);
     fs::path temp_path (const fs::path& model="%%%%-%%%%-%%%%-%%%%");
 
     class Slice;
@@ -250,8 +274,24 @@ namespace adsb2 {
         SL_SIZE
     };
 
+    // Compact storage of probability and mask channels, by adsb2.compact:
+    //  0: off, all CV_32F
+    //  1: PROB, POLAR_PROB and LABEL as CV_16U fixed point, 1/65535
+    //  2: the same as CV_8U, 1/255
+    // When on, the BFILTER mask is CV_8U 0/1.  Binary labels are exact
+    // in both modes, so areas do not change.  Snapshots are
+    // written compact and widened back to CV_32F on load; in memory,
+    // channels are compacted once no stage needs the float values
+    // (ImagePlan) and widened where float math is needed.
+    extern int compact_storage;
+    bool compact_channel (int channel);
+    // no-op if not a compact channel or compact_storage is off
+    cv::Mat compact_image (int channel, cv::Mat in);
+    // CV_32F, no copy if already
+    cv::Mat widen_image (int channel, cv::Mat in);
+
     struct Slice {
-        static int constexpr VERSION = 2;
+        static int constexpr VERSION = 3;   // 3: compact channels
         int id;
         fs::path path;          // must always present
         Meta meta;              // available after load_raw
@@ -295,7 +335,15 @@ namespace adsb2 {
         void clone (Slice *s) const; 
 
         void load_raw () {
-            cv::Mat raw = load_dicom(path, &meta);
+            set_raw(load_dicom(path, &meta));
+        }
+
+        // from DICOM data in memory, e.g. an archive member
+        void load_raw (string const &dicom) {
+            set_raw(load_dicom(dicom, path, &meta));
+        }
+
+        void set_raw (cv::Mat raw) {
             data[SL_COHORT] = meta.cohort;
 #if 1       // Yuanfang's annotation assume images are all in landscape position
             if ((raw.rows > raw.cols)
@@ -333,14 +381,19 @@ namespace adsb2 {
         void visualize (bool show_prob);
     };
 
+    class RawPack;
+
     class Series: public vector<Slice> {
         fs::path path;
+        // set when loaded from the pack of its study
+        std::shared_ptr<RawPack const> pack;
         bool sanity_check (bool fix = false);
         friend class Study;
     public:
 
         Series (){}
-        // load from a directory of DCM files
+        // load from a directory of DCM files, or from the pack or the
+        // archive of the study it is in, as Study::load_raw finds them
         Series (fs::path const &, bool load = true, bool check = true, bool fix = false);
 
         void save (std::ostream &os) const  {
@@ -389,6 +442,8 @@ namespace adsb2 {
 
     class Study: public vector<Series> {
         fs::path path;
+        // set when loaded from a raw pack, IM_RAW frames point into it
+        std::shared_ptr<RawPack const> pack;
         bool sanity_check (bool fix = false);
         void check_regroup ();  // some times its necessary to regroup one series into
                                 // multiple series
@@ -401,6 +456,9 @@ namespace adsb2 {
             load_raw(path, load, check, fix);
         }
 
+        // from a pack every frame is filled even if !load; from an
+        // archive only one is decoded if !load, the others have their
+        // member path, which Slice::load_raw cannot read
         void load_raw (fs::path const &, bool load = true, bool check = true, bool fix = false);
 
         void save (fs::path const &path) const;
@@ -445,6 +503,77 @@ namespace adsb2 {
         }
     };
 
+    // adsb2.pack: use <study>.pack in place of the DICOM directory
+    // <study> when it exists and is not older, default 1
+    extern int raw_pack;
+
+    // Raw frames and meta of one study in a single file, written by the
+    // pack tool; see adsb2-pack.cpp for layout.  The file is mmap-ed and
+    // Study::load_raw wraps the frames as IM_RAW without copy or DICOM
+    // decoding.
+    class RawPack {
+    public:
+        struct Series;
+        struct Frame;
+    private:
+        char *base;
+        size_t length;
+        unsigned n_series;
+        Series const *series;
+        Frame const *frames;
+        char const *strings;
+    public:
+        RawPack (fs::path const &path);
+        ~RawPack ();
+        RawPack (RawPack const &) = delete;
+        RawPack &operator = (RawPack const &) = delete;
+
+        // if file starts with the pack magic
+        static bool probe (fs::path const &path);
+        // pack to load for a study path: the path itself if it is a pack,
+        // or <path>.pack if adsb2.pack is on and not older than
+        // source_time(path); empty if none
+        static fs::path find (fs::path const &path);
+        // newest mtime of what a pack of study path is made from: the
+        // archive, or the study dir and its sax_* dirs; 0 if none
+        static std::time_t source_time (fs::path const &path);
+        // study must be loaded with load_raw(path, true, false, false)
+        static void save (fs::path const &path, Study const &study);
+
+        unsigned size () const { return n_series; }
+        fs::path series_path (unsigned i) const;
+        unsigned series_size (unsigned i) const;
+        // raw shares the mapping
+        void frame (unsigned i, unsigned j, fs::path *path, Meta *meta, cv::Mat *raw) const;
+    };
+
+    // Image lifetime of a pipeline.  Each stage declares the images it
+    // reads and writes, outputs declare the images they need at the end.
+    // After a stage runs, release() drops the images of every slice that
+    // no later stage reads and no output keeps.
+    class ImagePlan {
+        struct Stage {
+            string name;
+            std::bitset<IM_SIZE> uses;
+            std::bitset<IM_SIZE> makes;
+        };
+        vector<Stage> stages;
+        std::bitset<IM_SIZE> kept;
+        bool keep_extra;
+    public:
+        ImagePlan (): keep_extra(false) {
+        }
+        void add (string const &name, std::initializer_list<int> uses, std::initializer_list<int> makes);
+        void keep (std::initializer_list<int> images, bool extra = false);
+        void keep_all ();
+        // images read by the stages after stage
+        std::bitset<IM_SIZE> uses_after (string const &stage) const;
+        // images still needed after stage, those only kept for output
+        // are compacted by release (adsb2.compact)
+        std::bitset<IM_SIZE> live (string const &stage) const;
+        void release (string const &stage, Study *study) const;
+    };
+
     fs::path find24ch (fs::path const &, string const &pat = "2ch_");
 
     class Cook {
@@ -480,6 +609,35 @@ namespace adsb2 {
     class Detector;
     Detector *make_caffe_detector (fs::path const &path);
 
+    // Detectors and classifiers are created by named backends, which
+    // register themselves with a Registration object.  The backend of
+    // model <name> is adsb2.backend.<name> if set, otherwise
+    // adsb2.backend.detector (default caffe) or adsb2.backend.classifier
+    // (default xgboost).  Factories get the model path and the
+    // adsb2.backend subtree for their parameters.
+    template <typename T>
+    class Backends {
+    public:
+        typedef std::function<T *(fs::path const &, Config const &)> Factory;
+        static void add (string const &backend, Factory factory);
+        static T *create (string const &name);
+        static char const *kind ();             // detector or classifier
+        static char const *default_backend ();
+
+        struct Registration {
+            Registration (string const &backend, Factory factory) {
+                add(backend, factory);
+            }
+        };
+    };
+
+    class Classifier;
+    // defined in adsb2.cpp
+    template <> char const *Backends<Detector>::kind ();
+    template <> char const *Backends<Detector>::default_backend ();
+    template <> char const *Backends<Classifier>::kind ();
+    template <> char const *Backends<Classifier>::default_backend ();
+
     class Detector {
     public:
         virtual ~Detector () {}
@@ -488,20 +646,23 @@ namespace adsb2 {
         virtual void apply (vector<cv::Mat> &image, vector<cv::Mat> *prob) = 0;
         // get thread-local detector
         static Detector *get (string const &name);
-        static Detector *create (fs::path const &path) {
-            return make_caffe_detector(path);
+        static Detector *create (string const &name) {
+            return Backends<Detector>::create(name);
         }
     };
 
-    class Classifier;
     Classifier *make_xgboost_classifier (fs::path const &path);
 
     class Classifier {
     public:
+        virtual ~Classifier () {}
         virtual float apply (vector<float> const &) const = 0;
+        // n feature vectors of size dim, row major, into out[n];
+        // the default calls the above for each row
+        virtual void apply (unsigned n, unsigned dim, float const *ft, float *out) const;
         static Classifier *get (string const &name);
-        static Classifier *create (fs::path const &path) {
-            return make_xgboost_classifier(path);
+        static Classifier *create (string const &name) {
+            return Backends<Classifier>::create(name);
         }
     };
 
@@ -525,9 +686,16 @@ namespace adsb2 {
         int polar_kernel_size;
         cv::Mat polar_kernel;
         // = cv::Mat::ones(mk, mk, CV_8U);
+        unsigned seed;
 
-        std::default_random_engine e;
+        // distributions are copied so a const Sampler can be shared by threads
+        template <typename D, typename E>
+        static float draw (D d, E &e) {
+            return d(e);
+        }
     public:
+        typedef std::mt19937 Engine;
+
         Sampler (Config const &config)
             : max_color(config.get<float>("adsb2.aug.color", 20)),
             delta_color(-max_color, max_color),
@@ -540,27 +708,41 @@ namespace adsb2 {
             polar_C(0, config.get<float>("adsb2.aug.max_polar_C", 0.3)),
             polar_phi(0, M_PI * 2),
             polar_kernel_size(config.get<int>("adsb2.aug.polar_kernel", 3)),
-            polar_kernel(cv::Mat::ones(polar_kernel_size, polar_kernel_size, CV_8U))
+            polar_kernel(cv::Mat::ones(polar_kernel_size, polar_kernel_size, CV_8U)),
+            seed(config.get<unsigned>("adsb2.aug.seed", 1))
         {
         }
 
+        // Random stream of one sample, a function of the seed and
+        // (replica, id) only: augmentation takes no lock, and a build is
+        // reproduced exactly whatever the thread count or schedule.
+        // id = ~0U is reserved for shuffling the replica, and replica
+        // = ~0U for the sample order the folds are cut from.
+        Engine stream (unsigned replica, unsigned id) const;
+
+        Engine shuffle_stream (unsigned replica) const {
+            return stream(replica, ~0U);
+        }
+
+        Engine fold_stream () const {
+            return stream(~0U, ~0U);
+        }
+
         bool linear (cv::Mat from_image,
                     cv::Mat from_label,
                     cv::Mat *to_image,
-                    cv::Mat *to_label, bool no_perturb = false) {
+                    cv::Mat *to_label,
+                    Engine &e, bool no_perturb = false) const {
             if (no_perturb) {
                 *to_image = from_image;
                 *to_label = from_label;
                 return true;
             }
             float color, angle, scale, flip = false;
-#pragma omp critical
-            {
-                color = delta_color(e);
-                angle = linear_angle(e);
-                scale = std::exp(linear_scale(e));
-                //flip = ((e() % 2) == 1);
-            }
+            color = draw(delta_color, e);
+            angle = draw(linear_angle, e);
+            scale = std::exp(draw(linear_scale, e));
+            //flip = ((e() % 2) == 1);
             cv::Mat image, label;
             if (flip) {
                 cv::flip(from_image, image, 1);
@@ -581,7 +763,8 @@ namespace adsb2 {
                           cv::Mat from_label,
                           cv::Mat *to_image,
                           cv::Mat *to_label,
-                          bool no_perturb = false);
+                          Engine &e,
+                          bool no_perturb = false) const;
 
     };
 
@@ -621,7 +804,10 @@ namespace adsb2 {
     void Bound (Detector *det, Study *study, cv::Rect *box, Config const &config);
     void MotionFilter (Series *stack, Config const &config); 
     void FindSquare (cv::Mat &mat, cv::Rect *bbox, Config const &config);
+    void FindSquareNaive (cv::Mat &mat, cv::Rect *bbox, Config const &config);
 
+    // polar transformation around the bounding box of each slice
+    void ComputePolar (Study *study);
     void ComputeContourProb (Study *study, Config const &conf);
     void RefinePolarBound (Study *, Config const &config);
     void study_CA1 (Study *, Config const &config, bool);
@@ -629,6 +815,10 @@ namespace adsb2 {
     void ComputeTop (Study *study, Config const &conf);
     void RefineTop (Study *study, Config const &conf);
     void getColorBounds (Series &series, int color_bins, uint16_t *lb, uint16_t *ub);
+    void getColorBounds (Series &series, float *lb, float *ub);
+    // labels 8-bit binary mat with connected components (8-neighbor),
+    // returns # components and their total weight in cnt
+    int conn_comp (cv::Mat *mat, cv::Mat const &weight, vector<float> *cnt);
     void PatchBottomBound(Study *study, Config const &);
     void EvalBottom (Study *study, Config const &);
     void RefineBottom (Study *study, Config const &);
@@ -681,6 +871,8 @@ namespace adsb2 {
         typedef array<float,2> E;
     private:
         unordered_map<int, E> volumes;
+        // single pass, also validates x is a CDF
+        static float crps (float v, float const *x);
         static float crps (float v, vector<float> const &x);
     public:
         static constexpr unsigned VALUES = 600;
@@ -711,11 +903,84 @@ namespace adsb2 {
 
     class StudyReport: public vector<vector<SliceReport>> {
     public:
+        StudyReport () {}
+        // report.txt, or a single-study binary store (report.bin)
         StudyReport (fs::path const &);
         StudyReport (Study const &sss);
-        void dump (std::ostream &os);
+        void dump (std::ostream &os) const;
+    };
+
+    // Binary columnar report store, see adsb2-report.cpp for layout.
+    // One file holds the reports of one or many studies and is mmap-ed
+    // read-only; loading a study involves no text parsing.
+    class ReportStore {
+    public:
+        struct Entry;
+    private:
+        char const *base;
+        size_t length;
+        unsigned n_studies;
+        Entry const *studies;       // sorted by study_id
+        int32_t const *sax_id;
+        int32_t const *slice_id;
+        cv::Rect const *box;
+        cv::Rect const *polar_box;
+        Meta const *meta;
+        float const *data;          // SL_SIZE per slice
+        uint64_t const *path_off;   // n_slices + 1 offsets into strings
+        char const *strings;
+    public:
+        ReportStore (fs::path const &path);
+        ~ReportStore ();
+        ReportStore (ReportStore const &) = delete;
+        ReportStore &operator = (ReportStore const &) = delete;
+
+        // if file starts with the store magic
+        static bool probe (fs::path const &path);
+        // empty reports are skipped
+        static void save (fs::path const &path, vector<StudyReport const *> const &reports);
+
+        unsigned size () const {
+            return n_studies;
+        }
+        int study_id (unsigned i) const;
+        void load_at (unsigned i, StudyReport *) const;
+        // returns false if study not in store
+        bool load (int study_id, StudyReport *) const;
+    };
+
+    // Loads reports either from a directory tree of <study>/report.txt,
+    // as written by study, or from a binary store built by pack-report.
+    class ReportLoader {
+        fs::path root;
+        std::unique_ptr<ReportStore> store;
+    public:
+        ReportLoader (fs::path const &root);
+        // returns false if report not found or empty
+        bool load (int study, StudyReport *) const;
+        fs::path describe (int study) const;
     };
 
+    // Volume CDFs over Eval::VALUES bins, written into caller storage.
+    // GaussianCDF: normalized running sum of the Gaussian density sampled
+    // at each bin, the distribution GaussianAcc has always produced.
+    void GaussianCDF (float mu, float sigma, float *cdf);
+    // NormalCDF: continuous normal CDF at each bin, table driven.
+    void NormalCDF (float mu, float sigma, float *cdf);
+    // batch versions, cdf is n x Eval::VALUES row major
+    void GaussianCDF (unsigned n, float const *mu, float const *sigma, float *cdf);
+    void NormalCDF (unsigned n, float const *mu, float const *sigma, float *cdf);
+
+    static inline void GaussianCDF (float mu, float sigma, vector<float> *cdf) {
+        cdf->resize(Eval::VALUES);
+        GaussianCDF(mu, sigma, &cdf->at(0));
+    }
+
+    static inline void NormalCDF (float mu, float sigma, vector<float> *cdf) {
+        cdf->resize(Eval::VALUES);
+        NormalCDF(mu, sigma, &cdf->at(0));
+    }
+
     class GaussianAcc {
         //float extend;
     public:
@@ -761,7 +1026,8 @@ namespace adsb2 {
                       fs::path const &err,
                       Params const &params);
 
-        void tune (fs::path const &path, TuneParams const &, TuneResult *);
+        // the probe ranges and the chosen rounds are written to os
+        void tune (fs::path const &path, TuneParams const &, TuneResult *, std::ostream &os = std::cout);
     }
 
 }
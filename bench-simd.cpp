@@ -0,0 +1,279 @@
+#include <iostream>
+#include <random>
+#include <cstring>
+#include <functional>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "adsb2.h"
+
+using namespace std;
+using namespace adsb2;
+
+// Checks the simd kernels of every level this cpu supports against
+// the scalar versions, then times each kernel at each level on images
+// of the given size with the stage profiler (k:simd:<kernel>:<level>),
+// in the profile.csv format of bench-study.  Returns non-zero if any
+// kernel disagrees with scalar.
+
+namespace {
+
+    // edge values for the rounding and the zero tests
+    float const SPECIAL[] = {0.0f, -0.0f, 0.5f, -0.5f, 1.5f, 2.5f, 0.49999997f,
+                             -0.49999997f, 255.5f, 256.0f, 8388607.5f, -1e30f, 1e30f,
+                             numeric_limits<float>::infinity(),
+                             -numeric_limits<float>::infinity(),
+                             numeric_limits<float>::quiet_NaN()};
+    size_t const N_SPECIAL = sizeof(SPECIAL) / sizeof(SPECIAL[0]);
+
+    struct Data {
+        vector<float> v;
+        vector<uint8_t> mask;
+    };
+
+    // sparse values and masks with runs of zeros, so the extents
+    // fall anywhere in a row
+    void fill (Data *d, size_t n, std::mt19937 &rng, bool special) {
+        std::uniform_real_distribution<float> value(-300, 600);
+        std::uniform_int_distribution<int> pick(0, 99);
+        d->v.resize(n);
+        d->mask.resize(n);
+        int zeros = pick(rng);
+        for (size_t i = 0; i < n; ++i) {
+            int r = pick(rng);
+            if (special && r < 10) d->v[i] = SPECIAL[pick(rng) % N_SPECIAL];
+            else if (r < zeros) d->v[i] = 0;
+            else d->v[i] = value(rng);
+            d->mask[i] = (pick(rng) < zeros) ? 0 : pick(rng) % 3;
+        }
+    }
+
+    bool same_bits (float const *a, float const *b, size_t n) {
+        return memcmp(a, b, n * sizeof(float)) == 0;
+    }
+
+    bool close (double a, double b, double scale) {
+        return std::abs(a - b) <= 1e-5 * std::max(scale, 1.0);
+    }
+
+    typedef std::function<void (char const *, size_t, size_t)> Fail;
+
+    // the kernels that are bit exact with scalar on any input,
+    // special values included
+    void check_exact (float const *v, size_t n, size_t off, Fail const &fail) {
+        simd::Level level = simd::level();
+        float lb = -20, ub = 400;
+        vector<float> a(v, v + n), b(v, v + n);
+        simd::affine_round_clamp(a.data(), n, lb, 256, ub - lb, 0, 255);
+        simd::set_level(simd::SCALAR);
+        simd::affine_round_clamp(b.data(), n, lb, 256, ub - lb, 0, 255);
+        simd::set_level(level);
+        if (!same_bits(a.data(), b.data(), n)) fail("affine_round_clamp", n, off);
+        // identity, so the special values reach the rounding
+        a.assign(v, v + n);
+        b.assign(v, v + n);
+        simd::affine_round_clamp(a.data(), n, 0, 1, 1, -1e20, 1e20);
+        simd::set_level(simd::SCALAR);
+        simd::affine_round_clamp(b.data(), n, 0, 1, 1, -1e20, 1e20);
+        simd::set_level(level);
+        if (!same_bits(a.data(), b.data(), n)) fail("affine_round_clamp", n, off);
+
+        // only the columns, the row sum is in a different order
+        vector<float> X1(n, 1), X2(n, 1);
+        simd::project_row(v, n, X1.data());
+        simd::set_level(simd::SCALAR);
+        simd::project_row(v, n, X2.data());
+        simd::set_level(level);
+        if (!same_bits(X1.data(), X2.data(), n)) fail("project_row", n, off);
+
+        size_t f1 = 0, l1 = 0, f2 = 0, l2 = 0;
+        bool e1 = simd::nonzero_extent(v, n, &f1, &l1);
+        simd::set_level(simd::SCALAR);
+        bool e2 = simd::nonzero_extent(v, n, &f2, &l2);
+        simd::set_level(level);
+        if (e1 != e2 || (e1 && (f1 != f2 || l1 != l2))) fail("nonzero_extent<float>", n, off);
+    }
+
+    // every special value at every position of rows up to twice the
+    // widest vector, at every offset within one vector
+    void check_special (Fail const &fail) {
+        size_t const W = 16;        // floats in an AVX-512 register
+        vector<float> row(3 * W);
+        for (size_t n = 1; n <= 2 * W; ++n) {
+            for (size_t off = 0; off < W; ++off) {
+                for (size_t shift = 0; shift < N_SPECIAL; ++shift) {
+                    for (size_t i = 0; i < n; ++i) {
+                        row[off + i] = SPECIAL[(i + shift) % N_SPECIAL];
+                    }
+                    check_exact(row.data() + off, n, off, fail);
+                }
+            }
+        }
+    }
+
+    // returns number of failed checks at the current level
+    int check (std::mt19937 &rng, int rounds) {
+        simd::Level level = simd::level();
+        int bad = 0;
+        Fail fail = [&bad, level](char const *kernel, size_t n, size_t off) {
+            LOG(ERROR) << kernel << " at " << simd::name(level) << " differs from scalar, n=" << n << " offset=" << off;
+            ++bad;
+        };
+        check_special(fail);
+        for (int r = 0; r < rounds; ++r) {
+            size_t n = r % 300;
+            size_t off = r % 7;         // unaligned starts
+            Data d;
+            fill(&d, n + off, rng, r % 2 == 0);
+            float const *v = d.v.data() + off;
+            uint8_t const *mask = d.mask.data() + off;
+            check_exact(v, n, off, fail);
+
+            // sums are compared without the special values
+            Data f;
+            fill(&f, n + off, rng, false);
+            float s1, s2;
+            uint64_t m1, m2;
+            double scale = 0;
+            for (size_t i = off; i < n + off; ++i) scale += std::abs(f.v[i]);
+            simd::masked_sum(f.v.data() + off, f.mask.data() + off, n, &s1, &m1);
+            simd::set_level(simd::SCALAR);
+            simd::masked_sum(f.v.data() + off, f.mask.data() + off, n, &s2, &m2);
+            simd::set_level(level);
+            if (m1 != m2 || !close(s1, s2, scale)) fail("masked_sum", n, off);
+
+            vector<float> X1(n, 1), X2(n, 1);
+            s1 = simd::project_row(f.v.data() + off, n, X1.data());
+            simd::set_level(simd::SCALAR);
+            s2 = simd::project_row(f.v.data() + off, n, X2.data());
+            simd::set_level(level);
+            if (!same_bits(X1.data(), X2.data(), n) || !close(s1, s2, scale)) fail("project_row", n, off);
+
+            size_t f1 = 0, l1 = 0, f2 = 0, l2 = 0;
+            bool e1 = simd::nonzero_extent(mask, n, &f1, &l1);
+            simd::set_level(simd::SCALAR);
+            bool e2 = simd::nonzero_extent(mask, n, &f2, &l2);
+            simd::set_level(level);
+            if (e1 != e2 || (e1 && (f1 != f2 || l1 != l2))) fail("nonzero_extent<uint8_t>", n, off);
+        }
+        return bad;
+    }
+
+    void bench (Data const &d, int rows, int cols, int repeat) {
+        string level = simd::name(simd::level());
+        size_t n = size_t(rows) * cols;
+        auto scope = [&level](char const *kernel) {
+            return fmt::format("k:simd:{}:{}", kernel, level);
+        };
+        {
+            vector<float> v(d.v);
+            string name = scope("affine_round_clamp");
+            Profile::Scope k(name.c_str());
+            for (int r = 0; r < repeat; ++r) {
+                std::copy(d.v.begin(), d.v.end(), v.begin());
+                simd::affine_round_clamp(v.data(), n, -20, 256, 420, 0, 255);
+            }
+            k.slices(repeat);
+        }
+        {
+            string name = scope("masked_sum");
+            Profile::Scope k(name.c_str());
+            float s;
+            uint64_t m;
+            for (int r = 0; r < repeat; ++r) {
+                simd::masked_sum(d.v.data(), d.mask.data(), n, &s, &m);
+            }
+            k.slices(repeat);
+        }
+        {
+            string name = scope("project_row");
+            Profile::Scope k(name.c_str());
+            vector<float> X(cols);
+            for (int r = 0; r < repeat; ++r) {
+                std::fill(X.begin(), X.end(), 0);
+                for (int y = 0; y < rows; ++y) {
+                    simd::project_row(d.v.data() + size_t(y) * cols, cols, X.data());
+                }
+            }
+            k.slices(repeat);
+        }
+        {
+            string name = scope("nonzero_extent_f32");
+            Profile::Scope k(name.c_str());
+            size_t first, last;
+            for (int r = 0; r < repeat; ++r) {
+                for (int y = 0; y < rows; ++y) {
+                    simd::nonzero_extent(d.v.data() + size_t(y) * cols, cols, &first, &last);
+                }
+            }
+            k.slices(repeat);
+        }
+        {
+            string name = scope("nonzero_extent_u8");
+            Profile::Scope k(name.c_str());
+            size_t first, last;
+            for (int r = 0; r < repeat; ++r) {
+                for (int y = 0; y < rows; ++y) {
+                    simd::nonzero_extent(d.mask.data() + size_t(y) * cols, cols, &first, &last);
+                }
+            }
+            k.slices(repeat);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    fs::path output;
+    int size;
+    int repeat;
+    int rounds;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("output,o", po::value(&output), "csv output, stdout if not given")
+    ("size", po::value(&size)->default_value(256), "image rows and cols")
+    ("repeat", po::value(&repeat)->default_value(1000), "images per kernel")
+    ("rounds", po::value(&rounds)->default_value(3000), "random checks per level")
+    ;
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cerr << "ADSB2 VERSION: " << VERSION << endl;
+        cerr << desc;
+        return 1;
+    }
+    Profile::enabled = true;
+
+    std::mt19937 rng(2016);
+    Data d;
+    fill(&d, size_t(size) * size, rng, false);
+    // mostly-zero rows, as in label masks
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            if (x < size / 3 || x > size * 2 / 3) {
+                d.mask[size_t(y) * size + x] = 0;
+            }
+        }
+    }
+    simd::Level best = simd::detect();
+    int bad = 0;
+    for (int l = simd::SCALAR; l <= best; ++l) {
+        simd::set_level(simd::Level(l));
+        int b = check(rng, rounds);
+        cerr << simd::name(simd::Level(l)) << ": " << (b ? "FAILED" : "ok") << endl;
+        bad += b;
+        bench(d, size, size, repeat);
+    }
+    if (output.empty()) {
+        Profile::dump_csv(cout);
+    }
+    else {
+        fs::ofstream os(output);
+        Profile::dump_csv(os);
+    }
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "adsb2.h"
+
+using namespace std;
+using namespace adsb2;
+
+// Offline benchmark of the study pipeline, meant to run on studies
+// from gen-study (make bench).  Times each stage and the kernels
+// separately with the stage profiler, and writes the totals in the
+// profile.csv format so runs can be compared with diff or join.
+//
+// Unless --detector is given the analytic detector backend is used,
+// so no models are needed and the numbers do not depend on them.
+//
+// With --findbox the inputs are snapshots (study --os) and only the
+// FindSquare kernels are run, on the saved prob maps.
+//
+// With --startup only process startup is timed: GlobalInit and the
+// first two DICOM files of the first input, the first one paying for
+// the dcmtk dictionary.  Meant to be run once per process (make
+// bench-startup), with and without adsb2.dcmdict_minimal.
+
+// times FindSquare against FindSquareNaive on the prob maps
+// and returns the number of slices where the boxes differ
+static int bench_findsquare (vector<Slice *> const &slices, Config const &config) {
+    vector<cv::Rect> naive(slices.size()), fast(slices.size());
+    {
+        Profile::Scope k("k:FindSquareNaive");
+        for (unsigned i = 0; i < slices.size(); ++i) {
+            FindSquareNaive(slices[i]->images[IM_PROB], &naive[i], config);
+        }
+        k.slices(slices.size());
+    }
+    {
+        Profile::Scope k("k:FindSquare");
+        for (unsigned i = 0; i < slices.size(); ++i) {
+            FindSquare(slices[i]->images[IM_PROB], &fast[i], config);
+        }
+        k.slices(slices.size());
+    }
+    int bad = 0;
+    for (unsigned i = 0; i < slices.size(); ++i) {
+        if (naive[i] != fast[i]) ++bad;
+    }
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string config_path;
+    vector<string> overrides;
+    vector<fs::path> inputs;
+    fs::path output;
+    fs::path json;
+    int repeat;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("config", po::value(&config_path)->default_value("adsb2.xml"), "config file")
+    ("override,D", po::value(&overrides), "override configuration.")
+    ("input,i", po::value(&inputs), "study directories")
+    ("output,o", po::value(&output), "csv output, stdout if not given")
+    ("json", po::value(&json), "also write json")
+    ("repeat", po::value(&repeat)->default_value(3), "")
+    ("detector", "use the configured detector backend")
+    ("findbox", "inputs are snapshots, only bench FindSquare")
+    ("startup", "only time startup and the first DICOM files")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || inputs.empty()) {
+        cerr << "ADSB2 VERSION: " << VERSION << endl;
+        cerr << desc;
+        return 1;
+    }
+    Config config;
+    try {
+        LoadConfig(config_path, &config);
+    } catch (...) {
+        cerr << "Failed to load config file: " << config_path << ", using defaults." << endl;
+    }
+    if (vm.count("detector") == 0) {
+        config.put("adsb2.backend.detector", "analytic");
+    }
+    OverrideConfig(overrides, &config);
+    config.put("adsb2.profile", 1);
+    if (vm.count("startup")) {
+        config.put("adsb2.pack", 0);    // time the DICOM path
+        Profile::enabled = true;
+        {
+            Profile::Scope _("startup:init");
+            GlobalInit(argv[0], config);
+        }
+        Study study;
+        study.load_raw(inputs[0], false);
+        vector<Slice *> slices;
+        study.pool(&slices);
+        CHECK(slices.size() >= 2);
+        {
+            Profile::Scope k("startup:first_dicom");
+            slices[0]->load_raw();
+            k.slices(1);
+        }
+        {
+            Profile::Scope k("startup:next_dicom");
+            slices[1]->load_raw();
+            k.slices(1);
+        }
+        Profile::dump_csv(cout);
+        return 0;
+    }
+    GlobalInit(argv[0], config);
+    Cook cook(config);
+    bool findbox = vm.count("findbox") > 0;
+    int mismatch = 0;
+
+    for (int r = 0; r < repeat; ++r) {
+        for (auto const &input: inputs) {
+            if (findbox) {
+                Study study;
+                {
+                    Profile::Scope _("load", &study);
+                    study.load(input);
+                }
+                vector<Slice *> slices;
+                study.pool(&slices);
+                mismatch += bench_findsquare(slices, config);
+                continue;
+            }
+            Profile::reset_peak_rss();  // rss column is per study
+            Study study;
+            {
+                Profile::Scope _("load", &study);
+                study.load_raw(input, true, true, true);
+            }
+            {
+                Profile::Scope _("cook", &study);
+                cook.apply(&study);
+            }
+            vector<Slice *> slices;
+            study.pool(&slices);
+            {
+                Profile::Scope _("bound", &study);
+                ComputeBoundProb(&study);
+            }
+            {
+                Profile::Scope _("filter", &study);
+                ProbFilter(&study, config);
+            }
+            {
+                Profile::Scope _("findbox", &study);
+#pragma omp parallel for schedule(dynamic, 1)
+                for (unsigned i = 0; i < slices.size(); ++i) {
+                    FindBox(slices[i], config);
+                }
+            }
+            {
+                Profile::Scope _("polar", &study);
+                ComputePolar(&study);
+            }
+            {
+                Profile::Scope _("contour", &study);
+                ApplyDetector("contour", &study, IM_POLAR, IM_POLAR_PROB, 1.0, study.front().front().images[IM_IMAGE].rows/4);
+            }
+            {
+                Profile::Scope _("ca1", &study);
+                study_CA1(&study, config, false);
+            }
+            {
+                Profile::Scope _("minmax", &study);
+                Volume min, max;
+                FindMinMaxVol(study, &min, &max, config);
+            }
+
+            // kernels, on the state left by the pipeline
+            {
+                Profile::Scope k("k:getColorBounds");
+                for (auto &ss: study) {
+                    float lb, ub;
+                    getColorBounds(ss, &lb, &ub);
+                    k.slices(ss.size());
+                }
+            }
+            {
+                Profile::Scope k("k:conn_comp");
+                for (auto &ss: study) {
+                    cv::Mat p;
+                    cv::normalize(ss.front().images[IM_PROB], p, 0, 255, cv::NORM_MINMAX, CV_8UC1);
+                    cv::threshold(p, p, 255 * 0.8, 255, cv::THRESH_BINARY);
+                    vector<float> cc;
+                    conn_comp(&p, ss.front().images[IM_VAR], &cc);
+                    k.slices(1);
+                }
+            }
+            {
+                Profile::Scope k("k:linearPolar");
+                for (Slice *s: slices) {
+                    if (!s->images[IM_POLAR].data) continue;
+                    cv::Mat polar;
+                    linearPolar(s->images[IM_IMAGE], &polar, s->polar_C, s->polar_R);
+                    k.slices(1);
+                }
+            }
+            {
+                Profile::Scope k("k:ca1");
+                for (Slice *s: slices) {
+                    study_CA1(s, config, false);
+                    k.slices(1);
+                }
+            }
+            mismatch += bench_findsquare(slices, config);
+        }
+    }
+    if (mismatch) {
+        LOG(WARNING) << "FindSquare differs from FindSquareNaive on " << mismatch << " slices";
+    }
+    if (output.empty()) {
+        Profile::dump_csv(cout);
+    }
+    else {
+        fs::ofstream os(output);
+        Profile::dump_csv(os);
+    }
+    if (!json.empty()) {
+        fs::ofstream os(json);
+        Profile::dump_json(os, fmt::format("bench repeat={} studies={}", repeat, inputs.size()));
+    }
+    return 0;
+}
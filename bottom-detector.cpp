@@ -20,16 +20,33 @@ namespace adsb2 {
         virtual float apply (vector<float> const &ft) const {
             //array<float, SL_SIZE> const &data) const {
             //vector<float> ft{data[SL_BSCORE], data[SL_PSCORE], data[SL_CSCORE], data[SL_CCOLOR], data[SL_ARATE]};
+            float out;
+            apply(1, ft.size(), &ft[0], &out);
+            return out;
+        }
+        // one DMatrix for the whole batch, xgboost predicts it
+        // block by block over the rows
+        virtual void apply (unsigned n, unsigned dim, float const *ft, float *out) const {
+            if (n == 0) return;
             DMatrixHandle dmat;
-            int r = XGDMatrixCreateFromMat(&ft[0], 1, ft.size(), 0, &dmat);
+            int r = XGDMatrixCreateFromMat(ft, n, dim, 0, &dmat);
+            CHECK(r == 0);
             bst_ulong len;
-            float const *out;
-            XGBoosterPredict(cfier, dmat, 0, 0, &len, &out);
-            return out[0];
+            float const *o;
+            r = XGBoosterPredict(cfier, dmat, 0, 0, &len, &o);
+            CHECK(r == 0);
+            CHECK(len == n);
+            std::copy(o, o + n, out);
+            XGDMatrixFree(dmat);
         }
     };
 
     Classifier *make_xgboost_classifier (fs::path const &path) {
         return new BottomDetectorImpl(path);
     }
+
+    static Backends<Classifier>::Registration xgboost_registration("xgboost",
+            [](fs::path const &path, Config const &) {
+                return make_xgboost_classifier(path);
+            });
 }
@@ -86,4 +86,9 @@ namespace adsb2 {
     Detector *make_caffe_detector (fs::path const &path) {
         return new CaffeDetector(path.native());
     }
+
+    static Backends<Detector>::Registration caffe_registration("caffe",
+            [](fs::path const &path, Config const &) {
+                return make_caffe_detector(path);
+            });
 }
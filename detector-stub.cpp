@@ -0,0 +1,73 @@
+#include <vector>
+#include "adsb2.h"
+
+namespace adsb2 {
+
+    // Analytic stand-ins for the models, so that the heuristic stages
+    // can be run and profiled without caffe, xgboost or model files.
+    // Select with -D adsb2.backend.detector=analytic and/or
+    // -D adsb2.backend.classifier=constant (or per model).
+
+    // Probability from intensity: the image is normalized to [0, 1],
+    // thresholded at adsb2.backend.analytic.th and smoothed.  Works for
+    // both the bound (cartesian) and contour (polar) models because the
+    // blood pool is the brightest region.  The classification output is
+    // the fraction of pixels above threshold.
+    class AnalyticDetector: public Detector {
+        float th;
+        int blur;
+    public:
+        AnalyticDetector (Config const &conf)
+            : th(conf.get<float>("analytic.th", 0.6)),
+            blur(conf.get<int>("analytic.blur", 5)) {
+            CHECK(blur % 2 == 1);
+        }
+        virtual void apply (cv::Mat image, cv::Mat *o) {
+            cv::Mat norm;
+            cv::normalize(image, norm, 0, 1, cv::NORM_MINMAX, CV_32F);
+            cv::threshold(norm, *o, th, 1, cv::THRESH_BINARY);
+            if (blur > 1) {
+                cv::GaussianBlur(*o, *o, cv::Size(blur, blur), 0);
+            }
+        }
+        virtual void apply (vector<cv::Mat> &images, vector<cv::Mat> *o) {
+            o->resize(images.size());
+            for (unsigned i = 0; i < images.size(); ++i) {
+                apply(images[i], &o->at(i));
+            }
+        }
+        virtual void apply (cv::Mat image, vector<float> *prob) {
+            cv::Mat o;
+            apply(image, &o);
+            float p = cv::mean(o)[0];
+            prob->resize(2);
+            prob->at(0) = 1 - p;
+            prob->at(1) = p;
+        }
+    };
+
+    // returns adsb2.backend.constant.value
+    class ConstantClassifier: public Classifier {
+        float value;
+    public:
+        ConstantClassifier (Config const &conf)
+            : value(conf.get<float>("constant.value", 0)) {
+        }
+        virtual float apply (vector<float> const &) const {
+            return value;
+        }
+        virtual void apply (unsigned n, unsigned, float const *, float *out) const {
+            std::fill(out, out + n, value);
+        }
+    };
+
+    static Backends<Detector>::Registration analytic_registration("analytic",
+            [](fs::path const &, Config const &conf) {
+                return new AnalyticDetector(conf);
+            });
+
+    static Backends<Classifier>::Registration constant_registration("constant",
+            [](fs::path const &, Config const &conf) {
+                return new ConstantClassifier(conf);
+            });
+}
@@ -1,5 +1,9 @@
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include <boost/lexical_cast.hpp>
 #include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcistrmb.h>
 #include <dcmtk/dcmimgle/dcmimage.h>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
@@ -8,10 +12,135 @@
 namespace adsb2 {
 
     extern fs::path home_dir;
+
+    // Compact dictionary (adsb2.dcmdict_minimal): just the tags load_meta,
+    // DicomImage and save_dicom use, instead of parsing the 4000 lines of
+    // dicom.dic at the first DICOM access.  Tags not listed here parse as
+    // UN in implicit VR files, which is harmless as they are never read.
+    // The full dictionary is loaded, and the file parsed again, only if
+    // a file cannot be parsed or one of the tags below came out as UN.
+    struct DictTag {
+        DcmTagKey key;
+        DcmEVR vr;
+        char const *name;
+        int vm_min, vm_max;
+    };
+
+    static DictTag const MINIMAL_DICT[] = {
+        // file meta information
+        {DCM_FileMetaInformationGroupLength, EVR_UL, "FileMetaInformationGroupLength", 1, 1},
+        {DCM_FileMetaInformationVersion, EVR_OB, "FileMetaInformationVersion", 1, 1},
+        {DCM_MediaStorageSOPClassUID, EVR_UI, "MediaStorageSOPClassUID", 1, 1},
+        {DCM_MediaStorageSOPInstanceUID, EVR_UI, "MediaStorageSOPInstanceUID", 1, 1},
+        {DCM_TransferSyntaxUID, EVR_UI, "TransferSyntaxUID", 1, 1},
+        {DCM_ImplementationClassUID, EVR_UI, "ImplementationClassUID", 1, 1},
+        {DCM_ImplementationVersionName, EVR_SH, "ImplementationVersionName", 1, 1},
+        {DCM_SourceApplicationEntityTitle, EVR_AE, "SourceApplicationEntityTitle", 1, 1},
+        // load_meta and save_dicom
+        {DCM_SpecificCharacterSet, EVR_CS, "SpecificCharacterSet", 1, DcmVariableVM},
+        {DCM_SOPClassUID, EVR_UI, "SOPClassUID", 1, 1},
+        {DCM_SOPInstanceUID, EVR_UI, "SOPInstanceUID", 1, 1},
+        {DCM_Modality, EVR_CS, "Modality", 1, 1},
+        {DCM_PatientSex, EVR_CS, "PatientSex", 1, 1},
+        {DCM_PatientAge, EVR_AS, "PatientAge", 1, 1},
+        {DCM_BodyPartExamined, EVR_CS, "BodyPartExamined", 1, 1},
+        {DCM_SliceThickness, EVR_DS, "SliceThickness", 1, 1},
+        {DCM_PercentPhaseFieldOfView, EVR_DS, "PercentPhaseFieldOfView", 1, 1},
+        {DCM_TriggerTime, EVR_DS, "TriggerTime", 1, 1},
+        {DCM_NominalInterval, EVR_IS, "NominalInterval", 1, 1},
+        {DCM_CardiacNumberOfImages, EVR_IS, "CardiacNumberOfImages", 1, 1},
+        {DCM_ImagerPixelSpacing, EVR_DS, "ImagerPixelSpacing", 2, 2},
+        {DCM_SeriesNumber, EVR_IS, "SeriesNumber", 1, 1},
+        {DCM_ImagePositionPatient, EVR_DS, "ImagePositionPatient", 3, 3},
+        {DCM_ImageOrientationPatient, EVR_DS, "ImageOrientationPatient", 6, 6},
+        {DCM_SliceLocation, EVR_DS, "SliceLocation", 1, 1},
+        {DCM_PerformedProcedureStepID, EVR_SH, "PerformedProcedureStepID", 1, 1},
+        // image pixel module, read by DicomImage
+        {DCM_SamplesPerPixel, EVR_US, "SamplesPerPixel", 1, 1},
+        {DCM_PhotometricInterpretation, EVR_CS, "PhotometricInterpretation", 1, 1},
+        {DCM_PlanarConfiguration, EVR_US, "PlanarConfiguration", 1, 1},
+        {DCM_NumberOfFrames, EVR_IS, "NumberOfFrames", 1, 1},
+        {DCM_Rows, EVR_US, "Rows", 1, 1},
+        {DCM_Columns, EVR_US, "Columns", 1, 1},
+        {DCM_PixelSpacing, EVR_DS, "PixelSpacing", 2, 2},
+        {DCM_PixelAspectRatio, EVR_IS, "PixelAspectRatio", 2, 2},
+        {DCM_BitsAllocated, EVR_US, "BitsAllocated", 1, 1},
+        {DCM_BitsStored, EVR_US, "BitsStored", 1, 1},
+        {DCM_HighBit, EVR_US, "HighBit", 1, 1},
+        {DCM_PixelRepresentation, EVR_US, "PixelRepresentation", 1, 1},
+        {DCM_SmallestImagePixelValue, EVR_xs, "SmallestImagePixelValue", 1, 1},
+        {DCM_LargestImagePixelValue, EVR_xs, "LargestImagePixelValue", 1, 1},
+        {DCM_PixelPaddingValue, EVR_xs, "PixelPaddingValue", 1, 1},
+        {DCM_WindowCenter, EVR_DS, "WindowCenter", 1, DcmVariableVM},
+        {DCM_WindowWidth, EVR_DS, "WindowWidth", 1, DcmVariableVM},
+        {DCM_RescaleIntercept, EVR_DS, "RescaleIntercept", 1, 1},
+        {DCM_RescaleSlope, EVR_DS, "RescaleSlope", 1, 1},
+        {DCM_RescaleType, EVR_LO, "RescaleType", 1, 1},
+        {DCM_ModalityLUTSequence, EVR_SQ, "ModalityLUTSequence", 1, 1},
+        {DCM_VOILUTSequence, EVR_SQ, "VOILUTSequence", 1, 1},
+        {DCM_VOILUTFunction, EVR_CS, "VOILUTFunction", 1, 1},
+        {DCM_PixelData, EVR_ox, "PixelData", 1, 1},
+    };
+
+    static bool minimal_dict = false;
+    static string full_dict;
+    static std::once_flag full_dict_once;
+    static std::atomic<bool> full_dict_loaded(false);
+
+    static void unlock_dict () {
+#if PACKAGE_VERSION_NUMBER >= 361
+        dcmDataDict.wrunlock();
+#else
+        dcmDataDict.unlock();
+#endif
+    }
+
+    // loaded at most once, on top of the compact entries
+    static void load_full_dict () {
+        std::call_once(full_dict_once, []() {
+            LOG(WARNING) << "loading full DICOM dictionary " << full_dict;
+            DcmDataDictionary &dict = dcmDataDict.wrlock();
+            bool ok = dict.loadDictionary(full_dict.c_str());
+            unlock_dict();
+            CHECK(ok) << "cannot load DICOM dictionary " << full_dict;
+            full_dict_loaded = true;
+        });
+    }
+
+    // if a tag load_meta or DicomImage reads parsed as UN; other tags,
+    // e.g. PatientName or Manufacturer, may be unknown to the compact
+    // dictionary and do not matter
+    static bool needs_full_dict (DcmFileFormat &ff) {
+        if (!minimal_dict || full_dict_loaded) return false;
+        DcmDataset *ds = ff.getDataset();
+        for (auto const &t: MINIMAL_DICT) {
+            DcmElement *e;
+            if (ds->findAndGetElement(t.key, e).bad()) continue;
+            if (e->ident() == EVR_UN) {
+                LOG(WARNING) << t.name << " parsed as UN with the compact DICOM dictionary";
+                return true;
+            }
+        }
+        return false;
+    }
+
     void dicom_setup (char const *path, Config const &config) {
         fs::path def = home_dir / fs::path("dicom.dic");
         string v = config.get<string>("adsb2.dcmdict", def.native());
         setenv("DCMDICTPATH", v.c_str(), 0);
+        minimal_dict = config.get<int>("adsb2.dcmdict_minimal", 0) != 0;
+        if (!minimal_dict) return;
+        full_dict = getenv("DCMDICTPATH");
+        // dcmtk creates its dictionary from DCMDICTPATH at the first
+        // access; an empty file gives a loaded but empty dictionary
+        setenv("DCMDICTPATH", "/dev/null", 1);
+        DcmDataDictionary &dict = dcmDataDict.wrlock();
+        for (auto const &t: MINIMAL_DICT) {
+            dict.addEntry(new DcmDictEntry(t.key.getGroup(), t.key.getElement(),
+                                           DcmVR(t.vr), t.name, t.vm_min, t.vm_max));
+        }
+        unlock_dict();
+        setenv("DCMDICTPATH", full_dict.c_str(), 1);
     }
 
     template <typename T>
@@ -64,11 +193,8 @@ namespace adsb2 {
         };
         */
 
-    cv::Mat load_dicom (fs::path const &path, Meta *meta) {
-        CHECK(meta);
-        DcmFileFormat ff;
-        OFCondition status = ff.loadFile(path.c_str());
-        CHECK(status.good()) << "error loading dcm file: " << path;
+    // tags read into meta, path is only for messages
+    static void load_meta (DcmFileFormat &ff, fs::path const &path, Meta *meta) {
         string part = dicom_get<string>(ff, DCM_BodyPartExamined, path);
         LOG_IF(WARNING, part != "HEART") << "BodyPart " << part << " is not HEART: " << path;
         string sex = dicom_get<string>(ff, DCM_PatientSex, path);
@@ -120,6 +246,32 @@ namespace adsb2 {
             LOG(WARNING) << "cross product";
         }
         meta->z = cr.dot(meta->pos);
+    }
+
+    static cv::Mat load_pixels (DicomImage *dcm, Meta *meta) {
+        CHECK(dcm) << "fail to new DicomImage";
+        CHECK(dcm->getStatus() == EIS_Normal) << "fail to load dcm image";
+        CHECK(dcm->isMonochrome()) << " only monochrome data supported.";
+        CHECK(dcm->getDepth() == 16) << " only 16-bit data supported.";
+        CHECK(dcm->getFrameCount() == 1) << " only single-framed dcm supported.";
+        cv::Mat raw(dcm->getHeight(), dcm->getWidth(), CV_16U);
+        dcm->getOutputData(raw.ptr<uint16_t>(0), raw.total() * sizeof(uint16_t), 16);
+        delete dcm;
+        meta->width = raw.cols;
+        meta->height = raw.rows;
+        return raw;
+    }
+
+    cv::Mat load_dicom (fs::path const &path, Meta *meta) {
+        CHECK(meta);
+        DcmFileFormat ff;
+        OFCondition status = ff.loadFile(path.c_str());
+        if (minimal_dict && (status.bad() || needs_full_dict(ff))) {
+            load_full_dict();
+            status = ff.loadFile(path.c_str());
+        }
+        CHECK(status.good()) << "error loading dcm file: " << path;
+        load_meta(ff, path, meta);
 #if 0   // IMPORTANT: regular images do not have DiCOM meta data
         cv::Mat raw = cv::imread(path.native(), -1);
         if (!raw.data) {
@@ -132,19 +284,107 @@ namespace adsb2 {
             fs::remove(tmp);
         }
 #else
-        DicomImage *dcm = new DicomImage(path.c_str());
-        CHECK(dcm) << "fail to new DicomImage";
-        CHECK(dcm->getStatus() == EIS_Normal) << "fail to load dcm image";
-        CHECK(dcm->isMonochrome()) << " only monochrome data supported.";
-        CHECK(dcm->getDepth() == 16) << " only 16-bit data supported.";
-        CHECK(dcm->getFrameCount() == 1) << " only single-framed dcm supported.";
-        cv::Mat raw(dcm->getHeight(), dcm->getWidth(), CV_16U);
-        dcm->getOutputData(raw.ptr<uint16_t>(0), raw.total() * sizeof(uint16_t), 16);
-        delete dcm;
+        return load_pixels(new DicomImage(path.c_str()), meta);
 #endif
-        meta->width = raw.cols;
-        meta->height = raw.rows;
-        return raw;
+    }
+
+    cv::Mat load_dicom (string const &data, fs::path const &path, Meta *meta) {
+        CHECK(meta);
+        auto parse = [&data](DcmFileFormat *ff) {
+            DcmInputBufferStream is;
+            is.setBuffer(data.data(), data.size());
+            is.setEos();
+            ff->transferInit();
+            OFCondition status = ff->read(is);
+            ff->transferEnd();
+            return status;
+        };
+        std::unique_ptr<DcmFileFormat> ff(new DcmFileFormat);
+        OFCondition status = parse(ff.get());
+        if (minimal_dict && (status.bad() || needs_full_dict(*ff))) {
+            load_full_dict();
+            ff.reset(new DcmFileFormat);
+            status = parse(ff.get());
+        }
+        CHECK(status.good()) << "error parsing dcm data: " << path;
+        load_meta(*ff, path, meta);
+        DcmDataset *ds = ff->getDataset();
+        return load_pixels(new DicomImage(ds, ds->getOriginalXfer()), meta);
+    }
+
+    void save_dicom (fs::path const &path, cv::Mat raw, Meta const &meta) {
+        CHECK(raw.type() == CV_16U);
+        CHECK(raw.isContinuous());
+        DcmFileFormat ff;
+        DcmDataset *ds = ff.getDataset();
+        // deterministic instance uid, so generated files are reproducible
+        string uid = fmt::format("1.2.826.0.1.3680043.9.7433.{}", std::hash<string>()(path.native()) % 1000000000000ULL);
+        auto put = [ds, &path](DcmTagKey key, string const &v) {
+            CHECK(ds->putAndInsertString(key, v.c_str()).good()) << "cannot put element " << key << ": " << path;
+        };
+        auto num = [](float v) {
+            return fmt::format("{:g}", v);
+        };
+        put(DCM_SOPClassUID, UID_MRImageStorage);
+        put(DCM_SOPInstanceUID, uid);
+        put(DCM_Modality, "MR");
+        put(DCM_BodyPartExamined, "HEART");
+        put(DCM_PatientSex, meta[Meta::SEX] ? "F" : "M");
+        put(DCM_PatientAge, fmt::format("{:03d}Y", int(meta[Meta::AGE])));
+        put(DCM_SliceThickness, num(meta[Meta::SLICE_THICKNESS]));
+        put(DCM_NominalInterval, num(meta[Meta::NOMINAL_INTERVAL]));
+        put(DCM_SliceLocation, num(meta.slice_location));
+        put(DCM_CardiacNumberOfImages, lexical_cast<string>(int(meta[Meta::NUMBER_OF_IMAGES])));
+        put(DCM_SeriesNumber, lexical_cast<string>(int(meta[Meta::SERIES_NUMBER])));
+        put(DCM_TriggerTime, num(meta.trigger_time));
+        put(DCM_PixelSpacing, num(meta.raw_spacing) + "\\" + num(meta.raw_spacing));
+        put(DCM_PerformedProcedureStepID, meta.cohort ? "1" : "1234567890");
+        put(DCM_PercentPhaseFieldOfView, num(meta.PercentPhaseFieldOfView));
+        put(DCM_ImagePositionPatient, fmt::format("{:g}\\{:g}\\{:g}", meta.pos.x, meta.pos.y, meta.pos.z));
+        put(DCM_ImageOrientationPatient, fmt::format("{:g}\\{:g}\\{:g}\\{:g}\\{:g}\\{:g}",
+                    meta.ori_row.x, meta.ori_row.y, meta.ori_row.z,
+                    meta.ori_col.x, meta.ori_col.y, meta.ori_col.z));
+        // tags the competition files carry but adsb2 never reads, so
+        // bench-startup sees a realistic header
+        put(DCM_ImageType, "ORIGINAL\\PRIMARY\\M\\NORM\\DIS2D");
+        put(DCM_StudyDate, "20110101");
+        put(DCM_SeriesDate, "20110101");
+        put(DCM_StudyTime, "120000.000000");
+        put(DCM_SeriesTime, "120000.000000");
+        put(DCM_Manufacturer, "SIEMENS");
+        put(DCM_InstitutionName, "anonymous");
+        put(DCM_ManufacturerModelName, "Avanto");
+        put(DCM_StudyDescription, "Cardiac^Heart");
+        put(DCM_SeriesDescription, "sax");
+        put(DCM_PatientName, "anonymous");
+        put(DCM_PatientID, "anonymous");
+        put(DCM_PatientBirthDate, "19700101");
+        put(DCM_ScanningSequence, "GR");
+        put(DCM_SequenceVariant, "SK\\SS");
+        put(DCM_MRAcquisitionType, "2D");
+        put(DCM_RepetitionTime, "35.56");
+        put(DCM_EchoTime, "1.16");
+        put(DCM_MagneticFieldStrength, "1.5");
+        put(DCM_FlipAngle, "50");
+        put(DCM_ProtocolName, "sax");
+        put(DCM_PatientPosition, "HFS");
+        put(DCM_InPlanePhaseEncodingDirection, "ROW");
+        put(DCM_StudyInstanceUID, uid + ".1");
+        put(DCM_SeriesInstanceUID, uid + ".2");
+        put(DCM_FrameOfReferenceUID, uid + ".3");
+        put(DCM_StudyID, "1");
+        put(DCM_AcquisitionMatrix, "0\\256\\208\\0");
+        put(DCM_PhotometricInterpretation, "MONOCHROME2");
+        CHECK(ds->putAndInsertUint16(DCM_SamplesPerPixel, 1).good());
+        CHECK(ds->putAndInsertUint16(DCM_Rows, raw.rows).good());
+        CHECK(ds->putAndInsertUint16(DCM_Columns, raw.cols).good());
+        CHECK(ds->putAndInsertUint16(DCM_BitsAllocated, 16).good());
+        CHECK(ds->putAndInsertUint16(DCM_BitsStored, 16).good());
+        CHECK(ds->putAndInsertUint16(DCM_HighBit, 15).good());
+        CHECK(ds->putAndInsertUint16(DCM_PixelRepresentation, 0).good());
+        CHECK(ds->putAndInsertUint16Array(DCM_PixelData, raw.ptr<Uint16>(0), raw.total()).good());
+        OFCondition status = ff.saveFile(path.c_str(), EXS_LittleEndianExplicit);
+        CHECK(status.good()) << "error saving dcm file: " << path;
     }
 
 }
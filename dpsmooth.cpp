@@ -1,12 +1,18 @@
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <memory>
 #include <random>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <boost/multi_array.hpp>
 #include <boost/timer/timer.hpp>
-#define timer timer_for_boost_progress_t
-#include <boost/progress.hpp>
-#undef timer
 #include <boost/program_options.hpp>
+#include "adsb2-parse.h"
 
 using namespace std;
 
@@ -75,18 +81,239 @@ struct Task {
             }
         }
     }
+
+    // Exact solution of the same objective by slope trick:
+    // O(N log N) time and O(N) memory, no quantization.
+    // The max-heap holds the breakpoints of the optimal cost as a
+    // function of the last value; top is its smallest minimizer.
+    void optimize_exact () {
+        unsigned N = data.size();
+        if (N == 0) return;
+        priority_queue<float> heap;
+        vector<float> top(N);
+        for (unsigned i = 0; i < N; ++i) {
+            float y = data[i];
+            heap.push(y);
+            if (heap.top() > y) {
+                heap.pop();
+                heap.push(y);
+            }
+            top[i] = heap.top();
+        }
+        // backtrack: clip each minimizer by the value chosen after it
+        data[N-1] = top[N-1];
+        for (unsigned i = N-1; i > 0; --i) {
+            data[i-1] = min(top[i-1], data[i]);
+        }
+    }
+
+    void optimize (string const &method, unsigned M) {
+        if (method == "exact") optimize_exact();
+        else optimize(M);
+    }
+};
+
+// L1 objective of a fit
+static double cost (vector<float> const &data, vector<float> const &fit) {
+    double sum = 0;
+    for (unsigned i = 0; i < data.size(); ++i) {
+        sum += fabs(data[i] - fit[i]);
+    }
+    return sum;
+}
+
+// Solve the same random tasks with both methods, report time and objective.
+static void bench (vector<Task> const &tasks, unsigned M) {
+    vector<Task> grid(tasks), exact(tasks);
+    double tg, te;
+    {
+        boost::timer::cpu_timer timer;
+#pragma omp parallel for schedule(dynamic, 1)
+        for (unsigned i = 0; i < grid.size(); ++i) {
+            grid[i].optimize(M);
+        }
+        tg = timer.elapsed().wall / 1e9;
+    }
+    {
+        boost::timer::cpu_timer timer;
+#pragma omp parallel for schedule(dynamic, 1)
+        for (unsigned i = 0; i < exact.size(); ++i) {
+            exact[i].optimize_exact();
+        }
+        te = timer.elapsed().wall / 1e9;
+    }
+    double cg = 0, ce = 0, worst = 0;
+    for (unsigned i = 0; i < tasks.size(); ++i) {
+        double a = cost(tasks[i].data, grid[i].data);
+        double b = cost(tasks[i].data, exact[i].data);
+        BOOST_VERIFY(is_sorted(exact[i].data.begin(), exact[i].data.end()));
+        cg += a;
+        ce += b;
+        worst = min(worst, a - b);
+    }
+    cerr << "method\ttime(s)\tobjective" << endl;
+    cerr << "grid\t" << tg << '\t' << cg << endl;
+    cerr << "exact\t" << te << '\t' << ce << endl;
+    cerr << "speedup: " << tg / te << ", exact worse than grid by at most " << -worst << endl;
+}
+
+// Input is a sequence of tasks of N floats each, either text
+// (whitespace separated, line breaks not significant) or raw float32.
+class Reader {
+public:
+    virtual ~Reader () {}
+    // false at end of input, a trailing partial task is dropped
+    virtual bool read (unsigned N, vector<float> *v) = 0;
+};
+
+class TextReader: public Reader {
+    FILE *file;
+    vector<char> buf;
+    char const *p, *end;
+    bool eof;
+
+    // keep the unparsed tail and read more after it
+    void refill () {
+        size_t left = end - p;
+        BOOST_VERIFY(left < buf.size());    // token longer than buffer
+        memmove(&buf[0], p, left);
+        size_t n = fread(&buf[left], 1, buf.size() - left, file);
+        if (n == 0) eof = true;
+        p = &buf[0];
+        end = p + left + n;
+    }
+
+    bool next (float *v) {
+        for (;;) {
+            p = adsb2::parse::skip_space(p, end);
+            char const *q = p;
+            while (q < end && !adsb2::parse::is_space(*q)) ++q;
+            if (q == end && !eof) {     // token may continue
+                refill();
+                continue;
+            }
+            if (p == end) return false;
+            char const *r = adsb2::parse::parse_float(p, q, v);
+            if (r != q) {
+                cerr << "bad number: " << string(p, q) << endl;
+                return false;
+            }
+            p = q;
+            return true;
+        }
+    }
+public:
+    TextReader (FILE *f): file(f), buf(1 << 20), p(&buf[0]), end(p), eof(false) {
+    }
+
+    bool read (unsigned N, vector<float> *v) {
+        v->resize(N);
+        for (auto &a: *v) {
+            if (!next(&a)) return false;
+        }
+        return true;
+    }
+};
+
+class BinaryReader: public Reader {
+    FILE *file;
+public:
+    BinaryReader (FILE *f): file(f) {
+    }
+    bool read (unsigned N, vector<float> *v) {
+        v->resize(N);
+        return fread(&v->at(0), sizeof(float), N, file) == N;
+    }
+};
+
+class MappedReader: public Reader {
+    float const *data;
+    size_t size;    // in floats
+    size_t length;  // in bytes
+    size_t off;
+public:
+    MappedReader (string const &path): data(nullptr), size(0), length(0), off(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        BOOST_VERIFY(fd >= 0);
+        struct stat st;
+        BOOST_VERIFY(fstat(fd, &st) == 0);
+        length = st.st_size;
+        if (length) {
+            void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            BOOST_VERIFY(p != MAP_FAILED);
+            madvise(p, length, MADV_SEQUENTIAL);
+            data = reinterpret_cast<float const *>(p);
+            size = length / sizeof(float);
+        }
+        close(fd);
+    }
+    ~MappedReader () {
+        if (data) munmap(const_cast<float *>(data), length);
+    }
+    bool read (unsigned N, vector<float> *v) {
+        if (off + N > size) return false;
+        v->assign(data + off, data + off + N);
+        off += N;
+        return true;
+    }
+};
+
+class Writer {
+public:
+    virtual ~Writer () {}
+    virtual void write (vector<float> const &v) = 0;
+};
+
+// same text as cout << v[i] with tab separators
+class TextWriter: public Writer {
+    FILE *file;
+    vector<char> line;
+public:
+    TextWriter (FILE *f): file(f) {
+    }
+    void write (vector<float> const &v) {
+        line.resize(v.size() * 16 + 1);
+        char *p = &line[0];
+        for (unsigned i = 0; i < v.size(); ++i) {
+            if (i) *p++ = '\t';
+            p = adsb2::parse::format_float(v[i], p);
+        }
+        *p++ = '\n';
+        fwrite(&line[0], 1, p - &line[0], file);
+    }
+};
+
+class BinaryWriter: public Writer {
+    FILE *file;
+public:
+    BinaryWriter (FILE *f): file(f) {
+    }
+    void write (vector<float> const &v) {
+        fwrite(&v[0], sizeof(float), v.size(), file);
+    }
 };
 
 int main (int argc, char *argv[]) {
     namespace po = boost::program_options; 
     unsigned N, M, R = 0;
+    unsigned batch;
+    string method;
+    string input_path, output_path;
 
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
     (",N", po::value(&N)->default_value(600), "")
     (",M", po::value(&M)->default_value(1000),"")
+    ("method", po::value(&method)->default_value("grid"), "grid: DP over M levels; exact: slope trick")
     ("random", po::value(&R), "generate random testing data without optimization")
+    ("bench", "with --random, compare grid and exact methods")
+    ("input,i", po::value(&input_path)->default_value("-"), "")
+    ("output,o", po::value(&output_path)->default_value("-"), "")
+    ("binary-input", "input is raw float32")
+    ("binary-output", "output raw float32")
+    ("mmap", "input is a raw float32 file, mmap-ed")
+    ("batch", po::value(&batch)->default_value(4096), "tasks in memory at a time")
     ;
 
     po::positional_options_description p;
@@ -101,12 +328,20 @@ int main (int argc, char *argv[]) {
         return 1;
     }
 
-    vector<Task> tasks;
+    FILE *in = stdin, *out = stdout;
+    if (output_path != "-") {
+        out = fopen(output_path.c_str(), "wb");
+        BOOST_VERIFY(out);
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    unique_ptr<Writer> writer;
+    if (vm.count("binary-output")) writer.reset(new BinaryWriter(out));
+    else writer.reset(new TextWriter(out));
 
     if (vm.count("random")) {
         // generate random data for testing
         cerr << "Generating random data..." << endl;
-        tasks.resize(R);
+        vector<Task> tasks(R);
         default_random_engine gen;
         uniform_real_distribution<float> u(0, 1);
         for (auto &task: tasks) {
@@ -116,40 +351,54 @@ int main (int argc, char *argv[]) {
                 a = u(gen);
             }
         }
+        if (vm.count("bench")) {
+            bench(tasks, M);
+            return 0;
+        }
+        for (auto const &task: tasks) {
+            writer->write(task.data);
+        }
     }
     else {   // read input
-        vector<float> v;
-        for (;;) {
-            v.resize(N);
-            for (auto &a: v) {
-                cin >> a;
-            }
-            if (!cin) break;
-            tasks.push_back(Task());
-            tasks.back().data.swap(v);
+        unique_ptr<Reader> reader;
+        if (vm.count("mmap")) {
+            BOOST_VERIFY(input_path != "-");
+            reader.reset(new MappedReader(input_path));
         }
-        cerr << tasks.size() << " lines read." << endl;
-        {
-            boost::timer::auto_cpu_timer timer(cerr);
-            cerr << "Optimizing..." << endl;
-            boost::progress_display progress(tasks.size(), cerr);
-#pragma omp parallel for schedule(dynamic, 1)
-            for (unsigned i = 0; i < tasks.size(); ++i) {
-                tasks[i].optimize(M);
-#pragma omp critical
-                ++progress;
+        else {
+            if (input_path != "-") {
+                in = fopen(input_path.c_str(), "rb");
+                BOOST_VERIFY(in);
             }
+            if (vm.count("binary-input")) reader.reset(new BinaryReader(in));
+            else reader.reset(new TextReader(in));
         }
-    }
-    for (auto const &task: tasks) {
-        auto const &v = task.data;
-        for (unsigned i = 0;i < v.size(); ++i) {
-            if (i) cout << '\t';
-            cout << v[i];
+        // tasks are read and solved in batches, and each result is
+        // written in input order as soon as it is ready
+        boost::timer::auto_cpu_timer timer(cerr);
+        cerr << "Optimizing..." << endl;
+        vector<Task> tasks(batch);
+        size_t total = 0;
+        for (;;) {
+            unsigned n = 0;
+            while (n < batch && reader->read(N, &tasks[n].data)) {
+                ++n;
+            }
+#pragma omp parallel for ordered schedule(dynamic, 1)
+            for (unsigned i = 0; i < n; ++i) {
+                tasks[i].optimize(method, M);
+#pragma omp ordered
+                writer->write(tasks[i].data);
+            }
+            total += n;
+            if (n < batch) break;
         }
-        cout << endl;
+        cerr << total << " lines processed." << endl;
+        if (in != stdin) fclose(in);
     }
-
+    writer.reset();
+    if (out != stdout) fclose(out);
+    else fflush(out);
 
     return 0;
 }
@@ -0,0 +1,143 @@
+#include <cmath>
+#include <random>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "adsb2.h"
+
+using namespace std;
+using namespace adsb2;
+
+// Generates synthetic studies for benchmarking:
+//      <output>/<id>/study/sax_<n>/IM-<n>-<frame>.dcm
+// Each sax slice shows a body with a bright ellipse (blood pool in
+// a darker myocardium ring) that contracts and moves with the cardiac
+// phase, and shrinks towards the apex.  Output only depends on the
+// options, so benchmark data can be regenerated anywhere.
+struct Generator {
+    unsigned seed;
+    int size;
+    int saxes;
+    int frames;
+    float spacing;
+    float noise;
+
+    void gen_slice (int study, int sax, int frame, cv::Mat *raw, Meta *meta) const {
+        std::seed_seq sseq{seed, unsigned(study)};
+        std::seed_seq seq{seed, unsigned(study), unsigned(sax), unsigned(frame)};
+        std::mt19937 srng(sseq);    // study level variation
+        std::mt19937 rng(seq);
+        std::uniform_real_distribution<float> unif(-1, 1);
+        float cx = size * (0.5 + 0.05 * unif(srng));
+        float cy = size * (0.5 + 0.05 * unif(srng));
+        float angle = 45 * unif(srng);
+        float R0 = size * (0.09 + 0.02 * unif(srng));    // diastolic radius at base
+        float ef = 0.35 + 0.1 * unif(srng);                // radius contraction
+
+        float phase = 0.5 * (1 - std::cos(2 * M_PI * frame / frames));  // 0: diastole, 1: systole
+        float depth = float(sax) / saxes;
+        float r = R0 * std::sqrt(1 - depth * depth) * (1 - ef * phase);
+        cv::Point2f C(cx + 2 * std::sin(2 * M_PI * frame / frames), cy + 0.05 * size * depth);
+
+        cv::Mat img(size, size, CV_32F, cv::Scalar(20));
+        cv::ellipse(img, cv::RotatedRect(cv::Point2f(size/2, size/2), cv::Size2f(size * 0.85, size * 0.65), 0), cv::Scalar(300), -1);
+        cv::ellipse(img, cv::RotatedRect(C, cv::Size2f(2 * r + 14, 1.7 * r + 14), angle), cv::Scalar(180), -1);
+        cv::ellipse(img, cv::RotatedRect(C, cv::Size2f(2 * r, 1.7 * r), angle), cv::Scalar(900), -1);
+        cv::GaussianBlur(img, img, cv::Size(5, 5), 1.0);
+        std::normal_distribution<float> gauss(0, noise);
+        raw->create(size, size, CV_16U);
+        for (int y = 0; y < size; ++y) {
+            float const *p = img.ptr<float const>(y);
+            uint16_t *o = raw->ptr<uint16_t>(y);
+            for (int x = 0; x < size; ++x) {
+                float v = p[x] + gauss(rng);
+                o[x] = uint16_t(std::min(4095.0f, std::max(0.0f, std::round(v))));
+            }
+        }
+
+        float location = -10.0 * sax;
+        meta->at(Meta::SEX) = study % 2;
+        meta->at(Meta::AGE) = 30 + study % 50;
+        meta->at(Meta::SLICE_THICKNESS) = 8;
+        meta->at(Meta::NOMINAL_INTERVAL) = 1000;
+        meta->at(Meta::NUMBER_OF_IMAGES) = frames;
+        meta->at(Meta::SERIES_NUMBER) = sax + 5;
+        meta->at(Meta::SLICE_LOCATION_RAW) = meta->slice_location = location;
+        meta->trigger_time = 1000.0 * frame / frames;
+        meta->spacing = meta->raw_spacing = spacing;
+        meta->cohort = 0;
+        meta->PercentPhaseFieldOfView = 80;
+        meta->pos = cv::Point3f(-0.5 * size * spacing, -0.5 * size * spacing, location);
+        meta->ori_row = cv::Point3f(1, 0, 0);
+        meta->ori_col = cv::Point3f(0, 1, 0);
+        meta->z = location;
+    }
+};
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string config_path;
+    vector<string> overrides;
+    fs::path output;
+    int first, count;
+    Generator gen;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("config", po::value(&config_path)->default_value("adsb2.xml"), "config file")
+    ("override,D", po::value(&overrides), "override configuration.")
+    ("output,o", po::value(&output), "output root")
+    ("first", po::value(&first)->default_value(1), "first study id")
+    ("count,n", po::value(&count)->default_value(1), "number of studies")
+    ("seed", po::value(&gen.seed)->default_value(2016), "")
+    ("size", po::value(&gen.size)->default_value(256), "image size")
+    ("sax", po::value(&gen.saxes)->default_value(10), "sax series per study")
+    ("frames", po::value(&gen.frames)->default_value(30), "frames per series")
+    ("spacing", po::value(&gen.spacing)->default_value(1.4), "pixel spacing (mm)")
+    ("noise", po::value(&gen.noise)->default_value(30), "noise sigma")
+    ;
+
+    po::positional_options_description p;
+    p.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || output.empty()) {
+        cerr << "ADSB2 VERSION: " << VERSION << endl;
+        cerr << desc;
+        return 1;
+    }
+
+    Config config;
+    try {
+        LoadConfig(config_path, &config);
+    } catch (...) {
+        cerr << "Failed to load config file: " << config_path << ", using defaults." << endl;
+    }
+    OverrideConfig(overrides, &config);
+    // dcmtk needs the dictionary to write tags
+    GlobalInit(argv[0], config);
+
+    for (int study = first; study < first + count; ++study) {
+        for (int sax = 0; sax < gen.saxes; ++sax) {
+            fs::path dir = output / fs::path(lexical_cast<string>(study)) / fs::path("study")
+                            / fs::path(fmt::format("sax_{}", sax + 5));
+            fs::create_directories(dir);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int frame = 0; frame < gen.frames; ++frame) {
+                cv::Mat raw;
+                Meta meta;
+                gen.gen_slice(study, sax, frame, &raw, &meta);
+                save_dicom(dir / fs::path(fmt::format("IM-{:04d}-{:04d}.dcm", sax + 5, frame + 1)), raw, meta);
+            }
+        }
+        cerr << "study " << study << " generated." << endl;
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <queue>
+#include <cfloat>
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics/stats.hpp>
 #include <boost/accumulators/statistics/mean.hpp>
@@ -140,7 +141,7 @@ namespace adsb2 {
         cv::Rect bb = round(cscale(unround(ss[0].box), ext));
         if (bb.x < 0) bb.x = 0;
         if (bb.y < 0) bb.y = 0;
-#pragma omp parallel for
+#pragma omp parallel for num_threads(Threads::team())
         for (unsigned i = 0; i < study->size(); ++i) {
             study->at(i).shrink(bb);
         }
@@ -148,7 +149,7 @@ namespace adsb2 {
     }
 #endif
 
-    static int conn_comp (cv::Mat *mat, cv::Mat const &weight, vector<float> *cnt) {
+    int conn_comp (cv::Mat *mat, cv::Mat const &weight, vector<float> *cnt) {
         // return # components
         CHECK(mat->type() == CV_8UC1);
         CHECK(mat->isContinuous());
@@ -232,11 +233,12 @@ namespace adsb2 {
         cv::dilate(p, p, kernel);
         cv::Mat np;
         p.convertTo(np, CV_32F);
-#pragma omp parallel for
+        cv::Mat bf = compact_image(IM_BFILTER, np);
+#pragma omp parallel for num_threads(Threads::team())
         for (unsigned i = 0; i < stack.size(); ++i) {
             auto &s = stack[i];
             cv::Mat prob = s.images[IM_PROB].mul(np);
-            s.images[IM_BFILTER] = np;
+            s.images[IM_BFILTER] = bf;
             s.images[IM_PROB] = prob;
         }
         // find connected components of p
@@ -281,10 +283,11 @@ namespace adsb2 {
         cv::dilate(p, p, kernel);
         cv::Mat np;
         p.convertTo(np, CV_32F);
-#pragma omp parallel for
+        cv::Mat bf = compact_image(IM_BFILTER, np);
+#pragma omp parallel for num_threads(Threads::team())
         for (unsigned i = 0; i < slices.size(); ++i) {
             cv::Mat prob = slices[i]->images[IM_PROB].mul(np);
-            slices[i]->images[IM_BFILTER] = np;
+            slices[i]->images[IM_BFILTER] = bf;
             slices[i]->images[IM_PROB] = prob;
         }
         // find connected components of p
@@ -334,7 +337,8 @@ namespace adsb2 {
         }
     };
 
-    void FindSquare (cv::Mat &mat, cv::Rect *rect, Config const &config) {
+    // original implementation, kept as reference for bench-study --findbox
+    void FindSquareNaive (cv::Mat &mat, cv::Rect *rect, Config const &config) {
         float c_th = config.get<float>("adsb2.square.cth", 0.85); // probability cap
         float r_th = config.get<float>("adsb2.square.rth", 0.95) * M_PI/4;
         float b_th = config.get<float>("adsb2.square.bth", 0.75);
@@ -394,6 +398,117 @@ namespace adsb2 {
         *rect = seed;
     }
 
+    // Same search as FindSquareNaive with the same float arithmetic, but
+    // normalization, capping and the integral image are done in one pass
+    // into a per-thread buffer, and the seed positions are scanned in a
+    // vectorizable loop.  With adsb2.square.step > 1 the square grows
+    // coarse-to-fine: by step pixels while it improves, then by half
+    // the step, down to 1 pixel.  The default step 1 gives exactly the
+    // boxes of FindSquareNaive.
+    void FindSquare (cv::Mat &mat, cv::Rect *rect, Config const &config) {
+        float c_th = config.get<float>("adsb2.square.cth", 0.85); // probability cap
+        float r_th = config.get<float>("adsb2.square.rth", 0.95) * M_PI/4;
+        float b_th = config.get<float>("adsb2.square.bth", 0.75);
+        int step = config.get<int>("adsb2.square.step", 1);
+        CHECK(mat.type() == CV_32F);
+        CHECK(step >= 1);
+        static thread_local vector<float> buf;
+        static thread_local vector<float> colsum;
+        int const rows = mat.rows;
+        int const cols = mat.cols;
+        int const stride = cols + 1;
+        buf.resize(size_t(rows + 1) * stride);
+        colsum.assign(cols, 0);
+        std::fill(buf.begin(), buf.begin() + stride, 0);
+        {
+            // as cv::normalize(NORM_MINMAX), /= c_th and THRESH_TRUNC
+            double smin, smax;
+            cv::minMaxLoc(mat, &smin, &smax);
+            double dscale = (smax - smin) > DBL_EPSILON ? 1.0 / (smax - smin) : 0;
+            float scale = dscale;
+            float shift = -smin * dscale;
+            float cap = 1.0 / c_th;
+            float *a = &colsum[0];
+            for (int y = 0; y < rows; ++y) {
+                float const *from = mat.ptr<float const>(y);
+                float *to = &buf[size_t(y + 1) * stride];
+#pragma omp simd
+                for (int x = 0; x < cols; ++x) {
+                    float v = (from[x] * scale + shift) * cap;
+                    a[x] += v > 1 ? 1 : v;
+                }
+                to[0] = 0;
+                for (int x = 0; x < cols; ++x) {
+                    to[x+1] = to[x] + a[x];
+                }
+            }
+        }
+        auto sum = [stride](cv::Rect const &r) {
+            float const *row1 = &buf[size_t(r.y) * stride];
+            float const *row2 = &buf[size_t(r.y + r.height) * stride];
+            return row2[r.x + r.width] + row1[r.x]
+                 - row2[r.x] - row1[r.x + r.width];
+        };
+        cv::Rect seed;
+        bound(mat, &seed, b_th);
+        // find the best square within seed, first best wins
+        float best = -1;
+        {
+            cv::Rect c = seed;
+            int n;
+            if (seed.width <= seed.height) {
+                c.height = c.width;
+                n = seed.height + 1 - seed.width;
+            }
+            else {
+                c.width = c.height;
+                n = seed.width + 1 - seed.height;
+            }
+            int dx = seed.width <= seed.height ? 0 : 1;
+            int dy = 1 - dx;
+            vector<float> s(n);
+            float *ps = &s[0];
+#pragma omp simd
+            for (int i = 0; i < n; ++i) {
+                int x = c.x + i * dx;
+                int y = c.y + i * dy;
+                float const *row1 = &buf[size_t(y) * stride];
+                float const *row2 = &buf[size_t(y + c.height) * stride];
+                ps[i] = row2[x + c.width] + row1[x] - row2[x] - row1[x + c.width];
+            }
+            for (int i = 0; i < n; ++i) {
+                if (s[i] > best) {
+                    seed = c;
+                    seed.x += i * dx;
+                    seed.y += i * dy;
+                    best = s[i];
+                }
+            }
+        }
+        for (;;) {
+            bool updated = false;
+            cv::Rect from = seed;
+            for (int i = 0; i < 4; ++i) {
+                // grow towards one of the four corners
+                cv::Rect c(from.x - (i & 2 ? step : 0), from.y - (i & 1 ? step : 0),
+                           from.width + step, from.height + step);
+                if (c.x < 0 || c.y < 0 || c.x + c.width > cols || c.y + c.height > rows) continue;
+                float s = sum(c);
+                float r = s / c.area();
+                if ((s > best) && (r >= r_th)) {
+                    seed = c;
+                    best = s;
+                    updated = true;
+                }
+            }
+            if (updated) continue;
+            if (step == 1) break;
+            step /= 2;
+        }
+        CHECK(best > 0);
+        *rect = seed;
+    }
+
     void FindBox (Slice *slice, Config const &conf) {
         cv::Mat prob = slice->images[IM_PROB];
         FindSquare(prob, &slice->box, conf);
@@ -491,7 +606,7 @@ namespace adsb2 {
         *maxv = max;
     }
 
-    void ComputeContourProb (Study *study, Config const &conf)
+    void ComputePolar (Study *study)
     {
         for (Series &ss: *study) {
             /*
@@ -515,6 +630,11 @@ namespace adsb2 {
                 }
             }
         }
+    }
+
+    void ComputeContourProb (Study *study, Config const &conf)
+    {
+        ComputePolar(study);
         ApplyDetector("contour", study, IM_POLAR, IM_POLAR_PROB, 1.0, study->front().front().images[IM_IMAGE].rows/4);
     }
 
@@ -614,7 +734,7 @@ namespace adsb2 {
             std::cerr << "Computing top probablity of " << slices.size() << "  slices..." << std::endl;
             boost::progress_display progress(slices.size(), std::cerr);
             int bad = 0;
-#pragma omp parallel for schedule(dynamic, 1) reduction(+:bad)
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:bad) num_threads(Threads::team())
             for (unsigned i = 0; i < slices.size(); ++i) {
                 Detector *det = Detector::get("top");
                 CHECK(det) << " cannot create detector.";
@@ -661,14 +781,9 @@ namespace adsb2 {
 
     void PatchBottomBoundHelper (Slice *s, Config const &conf) {
         float mag = conf.get<float>("adsb2.patch_bb.mag", 2.0);
-        cv::Mat image;
-        s->images[IM_RAW].convertTo(image, CV_32F);
+        cv::Mat const &raw = s->images[IM_RAW];
         cv::Size sz = s->images[IM_IMAGE].size();
         cv::Size mag_sz = round(sz * mag);
-        cv::resize(image, image, mag_sz);
-        float lb = s->data[SL_COLOR_LB];
-        float ub = s->data[SL_COLOR_UB];
-        scale_color(&image, lb, ub);
 
         // center of the box
         cv::Point C(s->box.x + s->box.width/2,
@@ -678,22 +793,45 @@ namespace adsb2 {
 
         cv::Point roi_shift = mag_C - C;
 
-        cv::Rect bb(roi_shift, sz);
-
-        cv::Mat roi = image(bb).clone();
-        cv::Mat roi_prob;
         // we only detect a ROI in enlarged image
         // the ROI has the same size as the slice's image
         // the offset is picked, such that the enlarged box's center is still at C
         // relative to the ROI
+        // The magnified image is never built: the ROI is warped directly
+        // from the part of the raw image it covers, with the sampling
+        // cv::resize would use (x_raw = (x_mag + 0.5) * raw/mag_sz - 0.5).
+        float sx = float(raw.cols) / mag_sz.width;
+        float sy = float(raw.rows) / mag_sz.height;
+        float ox = (roi_shift.x + 0.5) * sx - 0.5;
+        float oy = (roi_shift.y + 0.5) * sy - 0.5;
+        cv::Rect src(std::floor(ox) - 1, std::floor(oy) - 1,
+                     std::ceil(sz.width * sx) + 3, std::ceil(sz.height * sy) + 3);
+        src &= cv::Rect(0, 0, raw.cols, raw.rows);
+        cv::Mat part;
+        raw(src).convertTo(part, CV_32F);
+        cv::Mat M = (cv::Mat_<double>(2, 3) << sx, 0, ox - src.x,
+                                                0, sy, oy - src.y);
+        cv::Mat roi;
+        cv::warpAffine(part, roi, M, sz, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+        float lb = s->data[SL_COLOR_LB];
+        float ub = s->data[SL_COLOR_UB];
+        scale_color(&roi, lb, ub);
+
+        cv::Mat roi_prob;
         Detector *det = Detector::get("bound");
         CHECK(det) << " cannot create detector.";
         det->apply(roi, &roi_prob);
-        cv::Mat prob(image.size(), CV_32F, cv::Scalar(0));
-        roi_prob.copyTo(prob(bb));
-        cv::resize(prob, prob, s->images[IM_PROB].size());
+        // back to slice coordinates, as resizing the magnified image
+        // with roi_prob pasted into zeros
+        cv::Mat prob;
+        cv::Size prob_sz = s->images[IM_PROB].size();
+        float px = float(mag_sz.width) / prob_sz.width;
+        float py = float(mag_sz.height) / prob_sz.height;
+        cv::Mat P = (cv::Mat_<double>(2, 3) << px, 0, 0.5 * px - 0.5 - roi_shift.x,
+                                                0, py, 0.5 * py - 0.5 - roi_shift.y);
+        cv::warpAffine(roi_prob, prob, P, prob_sz, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar(0));
         {
-            cv::Mat bf = s->images[IM_BFILTER];
+            cv::Mat bf = widen_image(IM_BFILTER, s->images[IM_BFILTER]);
             CHECK(bf.data) << "ProbFilter must be invoked before patching bb";
             cv::Mat tmp = prob.mul(bf);
             prob = tmp;
@@ -724,7 +862,7 @@ namespace adsb2 {
         }
         LOG(WARNING) << "Patching " << todo.size() << " bottom slices...";
         boost::progress_display progress(todo.size(), std::cerr);
-#pragma omp parallel for
+#pragma omp parallel for num_threads(Threads::team())
         for (unsigned i = 0; i < todo.size(); ++i) {
             PatchBottomBoundHelper(todo[i], conf);
 #pragma omp critical
@@ -751,15 +889,26 @@ namespace adsb2 {
                     cur[i].data[SL_ARATE] = 1.0;
                 }
             }
-            for (auto &s: cur) {
-                vector<float> ft{s.data[SL_BSCORE],
-                                 s.data[SL_PSCORE],
-                                 s.data[SL_CSCORE],
-                                 s.data[SL_CCOLOR],
-                                 s.data[SL_ARATE]};
-                s.data[SL_BOTTOM] = det->apply(ft);
+        }
+        // all slices in one batch
+        static int constexpr DIM = 5;
+        vector<Slice *> slices;
+        vector<float> ft;
+        for (unsigned i = l; i < study->size(); ++i) {
+            for (auto &s: study->at(i)) {
+                slices.push_back(&s);
+                ft.insert(ft.end(), {s.data[SL_BSCORE],
+                                     s.data[SL_PSCORE],
+                                     s.data[SL_CSCORE],
+                                     s.data[SL_CCOLOR],
+                                     s.data[SL_ARATE]});
             }
         }
+        vector<float> out(slices.size());
+        det->apply(slices.size(), DIM, ft.data(), out.data());
+        for (unsigned i = 0; i < slices.size(); ++i) {
+            slices[i]->data[SL_BOTTOM] = out[i];
+        }
     }
 
     void RefineBottomHelperSimple (vector<Slice *> &slices, Config const &conf) {
@@ -819,7 +968,7 @@ namespace adsb2 {
         }
         std::cerr << "Refining bottoms..." << std::endl;
         boost::progress_display progress(ns, std::cerr);
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(Threads::team())
         for (unsigned sid = 0; sid < ns; ++sid) {
             vector<Slice *> slices;
             for (unsigned j = 0; j < study->size(); ++j) {
@@ -18,6 +18,7 @@
 #include <caffe/util/io.hpp>
 
 #include "adsb2.h"
+#include "adsb2-import.h"
 
 using namespace std;
 using namespace boost;
@@ -29,7 +30,8 @@ string backend("lmdb");
 fs::path root;
 fs::path sample_dir;
 int sample_max = 100;
-int sample_count = 0;
+unsigned shards = 1;
+unsigned commit_size = 10000;
 
 void FindBoundingCircle (cv::Mat label, cv::Point_<float> *C, float *R) {
     int min_x = label.cols;
@@ -54,7 +56,7 @@ void FindBoundingCircle (cv::Mat label, cv::Point_<float> *C, float *R) {
     *R = std::sqrt(dx * dx + dy * dy);
 }
 
-void import (Sampler &sampler,
+void import (Sampler const &sampler,
              Cook &cook,
              vector<Slice *> &samples,
              fs::path const &dir,
@@ -63,27 +65,17 @@ void import (Sampler &sampler,
 
     CHECK(fs::create_directories(dir));
     CHECK(fs::is_directory(dir));
-    fs::path image_path = dir / fs::path("images");
-    fs::path label_path = dir / fs::path("labels");
-  // Create new DB
-    scoped_ptr<db::DB> image_db(db::GetDB(backend));
-    image_db->Open(image_path.string(), db::NEW);
-    scoped_ptr<db::Transaction> image_txn(image_db->NewTransaction());
+    DatumWriter writer(dir, backend, shards, commit_size);
 
-    scoped_ptr<db::DB> label_db(db::GetDB(backend));
-    label_db->Open(label_path.string(), db::NEW);
-    scoped_ptr<db::Transaction> label_txn(label_db->NewTransaction());
-
-    int count = 0;
-    Slice tmp;
     for (unsigned rr = 0; rr < replica; ++rr) {
         if (rr) {
-            random_shuffle(samples.begin(), samples.end());
+            std::shuffle(samples.begin(), samples.end(), sampler.shuffle_stream(rr));
         }
         cerr << "Loading replicate " << rr << "..." << endl;
         boost::progress_display progress(samples.size(), std::cerr);
-#pragma omp parallel for
+#pragma omp parallel for schedule(dynamic, 1)
         for (unsigned id = 0; id < samples.size(); ++id) {
+            uint64_t seq = uint64_t(rr) * samples.size() + id;
             Slice *dummy_sample = samples[id];
             Slice real_sample(*dummy_sample);
             real_sample.path = root / real_sample.path;
@@ -98,22 +90,20 @@ void import (Sampler &sampler,
 
             cv::Mat image, label;
             bool do_not_perturb = (rr == 0);
+            Sampler::Engine rng = sampler.stream(rr, id);
+            bool ok;
             if (polar) {
-                cv::Point_<float> C;
-                float R;
-                cv::Rect box;
-                if (!sampler.polar(sample->images[IM_IMAGE],
+                ok = sampler.polar(sample->images[IM_IMAGE],
                               sample->images[IM_LABEL],
-                              &image, &label, do_not_perturb)) {
-                    continue;
-                }
+                              &image, &label, rng, do_not_perturb);
             }
             else {
-                if (!sampler.linear(sample->images[IM_IMAGE], sample->images[IM_LABEL],
-                        &image, &label, do_not_perturb)) {
-                    continue;
-                }
-
+                ok = sampler.linear(sample->images[IM_IMAGE], sample->images[IM_LABEL],
+                        &image, &label, rng, do_not_perturb);
+            }
+            if (!ok) {
+                writer.skip(seq);
+                continue;
             }
             {
                 CHECK(image.type() == CV_32F);
@@ -126,42 +116,20 @@ void import (Sampler &sampler,
             cv::rectangle(image, round(sample->box), cv::Scalar(0xFF));
             imwrite((boost::format("abc/%d.png") % count).str(), image);
             */
-#pragma omp critical
-            {
-                Datum datum;
-                string key = lexical_cast<string>(count), value;
-                caffe::CVMatToDatum(image, &datum);
-                datum.set_label(0);
-                CHECK(datum.SerializeToString(&value));
-                image_txn->Put(key, value);
+            writer.put(seq, image, label);
 
-                caffe::CVMatToDatum(label, &datum);
-                datum.set_label(0);
-                CHECK(datum.SerializeToString(&value));
-                label_txn->Put(key, value);
-
-                if (sample_count < sample_max) {
-                    fs::path op(sample_dir / fs::path(fmt::format("s{}.jpg", sample_count++)));
-                    Mat out;
-                    vconcat(image, image + label * 255, out);
-                    imwrite(op.native(), out);
-                }
-
-                if (++count % 1000 == 0) {
-                    // Commit db
-                    image_txn->Commit();
-                    image_txn.reset(image_db->NewTransaction());
-                    label_txn->Commit();
-                    label_txn.reset(label_db->NewTransaction());
-                }
-                ++progress;
+            if (seq < uint64_t(sample_max)) {
+                fs::path op(sample_dir / fs::path(fmt::format("s{}.jpg", seq)));
+                Mat out;
+                vconcat(image, image + label * 255, out);
+                imwrite(op.native(), out);
             }
+#pragma omp critical
+            ++progress;
         }
     }
-    if (count % 1000 != 0) {
-      image_txn->Commit();
-      label_txn->Commit();
-    }
+    writer.close();
+    cerr << writer.size() << " records written to " << dir.native() << endl;
 }
 
 void save_list (vector<Slice *> const &samples, fs::path path) {
@@ -199,6 +167,8 @@ int main(int argc, char **argv) {
     ("output,o", po::value(&output_dir), "")
     ("replica", po::value(&replica)->default_value(1), "")
     ("polar", "")
+    ("shards", po::value(&shards)->default_value(1), "split output into this many databases")
+    ("commit", po::value(&commit_size)->default_value(10000), "records per transaction")
     ;
 
     po::positional_options_description p;
@@ -295,7 +265,7 @@ int main(int argc, char **argv) {
     }
     // N-fold cross validation
     vector<vector<Slice *>> folds(F);
-    random_shuffle(samples.begin(), samples.end());
+    std::shuffle(samples.begin(), samples.end(), sampler.fold_stream());
     for (unsigned i = 0; i < samples.size(); ++i) {
         folds[i % F].push_back(&samples[i]);
     }
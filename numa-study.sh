@@ -0,0 +1,41 @@
+#!/bin/bash
+
+### NUMA batch run of the first pass of run-study.sh.
+### One worker group per NUMA node: each runs ./study bound to its node
+### (adsb2.threads.node) on every N-th study of TRAIN and TEST, so the
+### frames and detector replicas stay in the node's memory.  The
+### "remote" column of each profile.csv is the memory that still ended
+### up on another node.  With numactl, each process also runs bound to
+### the node from the start, so memory allocated before adsb2 binds
+### itself (e.g. OpenBLAS buffers) stays local too.
+
+if [ ! -s raw -o ! -d raw ]
+then
+    echo Cannot find raw
+    exit
+fi
+
+NODES=
+for D in /sys/devices/system/node/node[0-9]*
+do
+    [ -d $D ] && NODES="$NODES ${D##*node}"
+done
+[ -z "$NODES" ] && NODES=0
+N=$(echo $NODES | wc -w)
+
+mkdir -p sum_study snapshot
+K=0
+for NODE in $NODES
+do
+    BIND=
+    if which numactl > /dev/null 2>&1
+    then
+        BIND="numactl --cpunodebind=$NODE --membind=$NODE"
+    fi
+    cat TRAIN TEST | awk -v n=$N -v k=$K 'NR % n == k' | while read a
+    do
+        $BIND ./study -D adsb2.threads.node=$NODE --profile raw/$a/study sum_study/$a --os snapshot/$a
+    done &
+    K=$((K + 1))
+done
+wait
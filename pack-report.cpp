@@ -0,0 +1,68 @@
+#include <iostream>
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "adsb2.h"
+
+using namespace std;
+using namespace adsb2;
+
+// Convert a tree of <study>/report.txt into a single binary report store.
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    vector<int> studies;
+    fs::path data_root; // report directory
+    fs::path output;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("data", po::value(&data_root), "dir containing report files")
+    ("output,o", po::value(&output), "output store")
+    ("input,i", po::value(&studies), "studies, read from stdin if not given")
+    ;
+
+    po::positional_options_description p;
+    p.add("data", 1);
+    p.add("output", 1);
+    p.add("input", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || data_root.empty() || output.empty()) {
+        cerr << "ADSB2 VERSION: " << VERSION << endl;
+        cerr << desc;
+        return 1;
+    }
+    google::InitGoogleLogging(argv[0]);
+
+    if (studies.empty()) {
+        int study;
+        while (cin >> study) {
+            studies.push_back(study);
+        }
+    }
+
+    ReportLoader loader(data_root);
+    vector<StudyReport> reports(studies.size());
+    vector<int> good(studies.size(), 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned i = 0; i < studies.size(); ++i) {
+        good[i] = loader.load(studies[i], &reports[i]);
+    }
+    vector<StudyReport const *> todo;
+    for (unsigned i = 0; i < studies.size(); ++i) {
+        if (!good[i]) {
+            LOG(ERROR) << "Fail to load data file: " << loader.describe(studies[i]).native();
+            continue;
+        }
+        todo.push_back(&reports[i]);
+    }
+    ReportStore::save(output, todo);
+    cerr << todo.size() << " of " << studies.size() << " studies saved to " << output.native() << endl;
+    return 0;
+}
+
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include "adsb2.h"
+
+using namespace std;
+using namespace adsb2;
+
+// Convert raw DICOM study directories into raw packs, so later runs
+// skip directory walking and DICOM decoding.  By default the pack of
+// raw/<id>/study is written to raw/<id>/study.pack, where
+// Study::load_raw finds it.
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    string config_path;
+    vector<string> overrides;
+    vector<fs::path> inputs;
+    fs::path output;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("config", po::value(&config_path)->default_value("adsb2.xml"), "config file")
+    ("override,D", po::value(&overrides), "override configuration.")
+    ("input,i", po::value(&inputs), "study directories, read from stdin if not given")
+    ("output,o", po::value(&output), "write <output>/<id>.pack instead, id being the parent of the study dir")
+    ("force", "repack even if the pack is up to date")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cerr << "ADSB2 VERSION: " << VERSION << endl;
+        cerr << desc;
+        return 1;
+    }
+    Config config;
+    try {
+        LoadConfig(config_path, &config);
+    } catch (...) {
+        cerr << "Failed to load config file: " << config_path << ", using defaults." << endl;
+    }
+    OverrideConfig(overrides, &config);
+    config.put("adsb2.pack", 0);    // always read the DICOM files
+    GlobalInit(argv[0], config);
+
+    if (inputs.empty()) {
+        string line;
+        while (getline(cin, line)) {
+            if (line.size()) inputs.push_back(line);
+        }
+    }
+    bool force = vm.count("force") > 0;
+    if (!output.empty()) {
+        fs::create_directories(output);
+    }
+    int done = 0;
+    Threads::Budget budget("pack");     // studies are outer, decoding inner
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:done)
+    for (unsigned i = 0; i < inputs.size(); ++i) {
+        fs::path const &input = inputs[i];
+        fs::path pack = output.empty() ? fs::path(input.native() + ".pack")
+                        : output / fs::path(input.parent_path().filename().native() + ".pack");
+        if (!force && fs::exists(pack)
+                && fs::last_write_time(pack) >= RawPack::source_time(input)) {
+            continue;
+        }
+        Study study;
+        study.load_raw(input, true, false, false);
+        RawPack::save(pack, study);
+        ++done;
+    }
+    cerr << done << " of " << inputs.size() << " studies packed." << endl;
+    return 0;
+}
@@ -13,22 +13,6 @@ static inline float sqr (float x) {
     return x * x;
 }
 
-void GaussianAcc (float v, float scale, vector<float> *s) {
-    s->resize(Eval::VALUES);
-    float sum = 0;
-    for (unsigned i = 0; i < Eval::VALUES; ++i) {
-        float x = (float(i) - v) / scale;
-        x = exp(-0.5 * x * x);
-        s->at(i) = x;
-        sum += x;
-    }
-    float acc = 0;
-    for (auto &v: *s) {
-        acc += v;
-        v = acc / sum;
-    }
-}
-
 bool compute1 (StudyReport const &rep, float *sys, float *dia) {
     vector<float> all(rep[0].size(), 0);
     for (unsigned i = 1; i < rep.size(); ++i) {
@@ -162,9 +146,9 @@ int main(int argc, char **argv) {
         float dia_mu = target_dia->apply(ft);
         float dia_sigma = 16; //sqrt(error_dia->apply(ft));
 
-        GaussianAcc(sys_mu, sys_sigma, &v);
+        GaussianCDF(sys_mu, sys_sigma, &v);
         cout << study << "_Systole" << '\t' << eval.score(study, 0, v) << endl;
-        GaussianAcc(dia_mu, dia_sigma, &v);
+        GaussianCDF(dia_mu, dia_sigma, &v);
         cout << study << "_Diastole" << '\t' << eval.score(study, 1, v) << endl;
     }
 }
@@ -84,7 +84,7 @@ int main(int argc, char **argv) {
     }
 
     ComputeContourProb(&study, config);
-    study_CA1(&study, config, true);
+    study_CA1(&study, config, false);
     
     if (output_dir.size()) {
         fs::path dir(output_dir);
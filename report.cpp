@@ -13,22 +13,6 @@ static inline float sqr (float x) {
     return x * x;
 }
 
-void GaussianAcc (float v, float scale, vector<float> *s) {
-    s->resize(Eval::VALUES);
-    float sum = 0;
-    for (unsigned i = 0; i < Eval::VALUES; ++i) {
-        float x = (float(i) - v) / scale;
-        x = exp(-0.5 * x * x);
-        s->at(i) = x;
-        sum += x;
-    }
-    float acc = 0;
-    for (auto &v: *s) {
-        acc += v;
-        v = acc / sum;
-    }
-}
-
 bool compute1 (StudyReport const &rep, float *sys, float *dia) {
     vector<float> all(rep[0].size(), 0);
     for (unsigned i = 1; i < rep.size(); ++i) {
@@ -143,9 +127,9 @@ int main(int argc, char **argv) {
         /*
         float dsys = gs_sys - sys;
         float ddia = gs_dia - dia;
-        GaussianAcc(sys, scale, &v);
+        GaussianCDF(sys, scale, &v);
         cout << study << "_Systole" << '\t' << eval.score(study, 0, v) << '\t' << dsys << '\t' << gs_sys << '\t' << sys << '\t' << (dsys-ddia) << '\t' << dgap << endl;
-        GaussianAcc(dia, scale, &v);
+        GaussianCDF(dia, scale, &v);
         cout << study << "_Diastol" << '\t' << eval.score(study, 1, v) << '\t' << ddia << '\t' << gs_dia << '\t' << dia << '\t' << (dsys-ddia) << '\t' << dgap << endl;
         */
     }
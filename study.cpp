@@ -52,6 +52,7 @@ int main(int argc, char **argv) {
     fs::path input_path;
     fs::path dir;
     fs::path snapshot_path;
+    string trace_path;
     int ca;
     string preset;
     /*
@@ -77,6 +78,9 @@ int main(int argc, char **argv) {
     ("preset", po::value(&preset), "")
     ("gif", "")
     ("gnuplot", "")
+    ("profile", "write profile.json and profile.csv to output dir")
+    ("trace", po::value(&trace_path), "write chrome trace, needs make TRACE=1")
+    ("keep-images", "do not release images after their last use")
     //("output,o", po::value(&output_dir), "")
     /*
     ("gif", po::value(&gif), "")
@@ -121,18 +125,55 @@ int main(int argc, char **argv) {
     }
 
     OverrideConfig(overrides, &config);
+    if (vm.count("profile")) {
+        config.put("adsb2.profile", 1);
+    }
+    if (trace_path.size()) {
+        config.put("adsb2.trace.path", trace_path);
+    }
 
     GlobalInit(argv[0], config);
     Cook cook(config);
 
+    // images are released after the last stage using them,
+    // snapshot keeps everything, gif needs the visualization
+    bool vis = do_gif || !snapshot_path.empty();
+    ImagePlan plan;
+    plan.add("load", {}, {IM_RAW});
+    plan.add("cook", {IM_RAW}, {IM_IMAGE, IM_VAR});
+    plan.add("top", {IM_IMAGE}, {});
+    plan.add("bound", {IM_IMAGE}, {IM_PROB});
+    plan.add("filter", {IM_IMAGE, IM_PROB, IM_VAR}, {IM_PROB, IM_BFILTER});
+    plan.add("findbox", {IM_PROB}, {});
+    plan.add("contour", {IM_IMAGE, IM_PROB}, {IM_POLAR, IM_POLAR_PROB});
+    plan.add("ca1", {IM_IMAGE, IM_POLAR, IM_POLAR_PROB}, {IM_LABEL});
+    plan.add("bottom", {}, {});
+#ifdef USE_TOP
+    plan.keep({IM_IMAGE2, IM_PROB2});
+#endif
+    if (do_gif) {
+        plan.keep({IM_IMAGE, IM_PROB}, true);
+    }
+    if (!snapshot_path.empty() || vm.count("keep-images")) {
+        plan.keep_all();
+    }
+
     timer::auto_cpu_timer timer(cerr);
     Study study;
     if (vm.count("snapshot")) {
+        Profile::Scope _("load", &study);
         study.load(input_path);
     }
     else {
-        study.load_raw(input_path, true, true, true);
-        cook.apply(&study);
+        {
+            Profile::Scope _("load", &study);
+            study.load_raw(input_path, true, true, true);
+        }
+        {
+            Profile::Scope _("cook", &study);
+            cook.apply(&study);
+            plan.release("cook", &study);
+        }
         cv::Rect bound;
         /*
         string bound_model = config.get("adsb2.caffe.bound_model", (home_dir/fs::path("bound_model")).native());
@@ -145,7 +186,9 @@ int main(int argc, char **argv) {
         vector<Slice *> slices;
         study.pool(&slices);
         if (vm.count("top")) {
+            Profile::Scope _("top", &study);
             ComputeTop(&study, config);
+            plan.release("top", &study);
         }
 #ifdef USE_TOP
         for (auto &ss: study) {
@@ -162,7 +205,11 @@ int main(int argc, char **argv) {
             }
         }
 #endif
-        ComputeBoundProb(&study);
+        {
+            Profile::Scope _("bound", &study);
+            ComputeBoundProb(&study);
+            plan.release("bound", &study);
+        }
 #ifdef USE_TOP
         ApplyDetector("top_bound", &study, IM_IMAGE2, IM_PROB2, 1.0, 0);
         for (Slice *s: slices) {
@@ -173,19 +220,36 @@ int main(int argc, char **argv) {
         }
 #endif
         cerr << "Filtering..." << endl;
-        ProbFilter(&study, config);
+        {
+            Profile::Scope _("filter", &study);
+            ProbFilter(&study, config);
+            plan.release("filter", &study);
+        }
         cerr << "Finding squares..." << endl;
+        {
+            Profile::Scope _("findbox", &study);
 #pragma omp parallel for schedule(dynamic, 1)
-        for (unsigned i = 0; i < slices.size(); ++i) {
-            FindBox(slices[i], config);
+            for (unsigned i = 0; i < slices.size(); ++i) {
+                FindBox(slices[i], config);
+            }
+            plan.release("findbox", &study);
         }
-
-        ComputeContourProb(&study, config);
+        {
+            Profile::Scope _("contour", &study);
+            ComputeContourProb(&study, config);
+            plan.release("contour", &study);
+        }
+    }
+    {
+        Profile::Scope _("ca1", &study);
+        study_CA1(&study, config, vis);
+        plan.release("ca1", &study);
     }
-    study_CA1(&study, config, true);
     if (vm.count("bottom")) {
+        Profile::Scope _("bottom", &study);
         EvalBottom(&study, config);
         RefineBottom(&study, config);
+        plan.release("bottom", &study);
     }
 #if 0
     if (decap > 0) {
@@ -203,8 +267,12 @@ int main(int argc, char **argv) {
 #endif
     
     Volume min, max;
-    FindMinMaxVol(study, &min, &max, config);
+    {
+        Profile::Scope _("minmax", &study);
+        FindMinMaxVol(study, &min, &max, config);
+    }
     if (!snapshot_path.empty()) {
+        Profile::Scope _("snapshot", &study);
         fs::path parent = snapshot_path.parent_path();
         if (!parent.empty()) {
             fs::create_directories(parent);
@@ -243,6 +311,7 @@ int main(int argc, char **argv) {
         gp << "set dgrid3d 50,50 qnorm 2;" << endl;
         gp << "splot '-' using 1:2:3 notitle" << endl;
         if (do_gif) {
+            Profile::Scope _("gif", &study);
 #pragma omp parallel for
             for (unsigned i = 0; i < study.size(); ++i) {
                 study[i].visualize();
@@ -259,35 +328,18 @@ int main(int argc, char **argv) {
         }
         gp << 'e' << endl;
         html << "</table></body></html>" << endl;
-        fs::ofstream os(dir/fs::path("report.txt"));
-        for (unsigned i = 0; i < study.size(); ++i) {
-            auto const &series = study[i];
-            for (unsigned j = 0; j < series.size(); ++j) {
-                auto const &s = series[j];
-                os << s.path.native()
-                    << '\t' << i
-                    << '\t' << j
-                    << '\t' << s.data[SL_AREA]
-                    << '\t' << s.box.x
-                    << '\t' << s.box.y
-                    << '\t' << s.box.width
-                    << '\t' << s.box.height
-                    << '\t' << s.polar_box.x
-                    << '\t' << s.polar_box.y
-                    << '\t' << s.polar_box.width
-                    << '\t' << s.polar_box.height
-                    << '\t' << s.meta.slice_location
-                    << '\t' << s.meta.trigger_time
-                    << '\t' << s.meta.spacing
-                    << '\t' << s.meta.raw_spacing;
-                for (auto const &v: s.meta) {
-                    os << '\t' << v;
-                }
-                for (auto const &v: s.data) {
-                    os << '\t' << v;
-                }
-                os << std::endl;
-            }
+        {
+            Profile::Scope _("report", &study);
+            StudyReport rep(study);
+            fs::ofstream os(dir/fs::path("report.txt"));
+            rep.dump(os);
+            ReportStore::save(dir/fs::path("report.bin"), {&rep});
+        }
+        if (Profile::enabled) {
+            fs::ofstream json(dir/fs::path("profile.json"));
+            Profile::dump_json(json, input_path.native());
+            fs::ofstream csv(dir/fs::path("profile.csv"));
+            Profile::dump_csv(csv);
         }
         if (vm.count("gnuplot")) {
             fs::path gp2(dir/fs::path("plot2.gp"));
@@ -310,6 +362,7 @@ int main(int argc, char **argv) {
         }
     }
     */
+    cerr << "Peak RSS: " << Profile::peak_rss() << " KB" << endl;
     return 0;
 }
 
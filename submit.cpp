@@ -18,14 +18,6 @@ struct Case {
     Volume max;
 };
 
-void GaussianAcc (Volume const &v, float scale, vector<float> *s) {
-    s->clear();
-    for (unsigned i = 0; i < Eval::VALUES; ++i) {
-        float x = -(float(i) * 1000 - v.mean) / scale;
-        s->push_back(0.5*erfc(x));
-    }
-}
-
 int main(int argc, char **argv) {
     //Series stack("sax", "tmp");
     namespace po = boost::program_options; 
@@ -96,10 +88,25 @@ int main(int argc, char **argv) {
     if (!do_eval) {
         cout << HEADER << endl;
     }
-    Eval eval;
+    // all CDFs in one batch, rows: diastole, systole of each case;
+    // volume.txt is in 1/1000 of a bin, and the former 0.5 * erfc(-(i - mean) / scale)
+    // is the normal CDF with sigma = scale / sqrt(2)
+    vector<float> mu, sigma;
     for (auto const &c: cases) {
-        vector<float> v;
-        GaussianAcc(c.max, scale, &v);
+        mu.push_back(c.max.mean / 1000);
+        mu.push_back(c.min.mean / 1000);
+        sigma.push_back(scale / 1000 / M_SQRT2);
+        sigma.push_back(scale / 1000 / M_SQRT2);
+    }
+    vector<float> cdf(mu.size() * Eval::VALUES);
+    if (mu.size()) {
+        NormalCDF(mu.size(), &mu[0], &sigma[0], &cdf[0]);
+    }
+    Eval eval;
+    for (unsigned i = 0; i < cases.size(); ++i) {
+        auto const &c = cases[i];
+        vector<float> v(cdf.begin() + (2 * i) * Eval::VALUES,
+                        cdf.begin() + (2 * i + 1) * Eval::VALUES);
         cout << c.id << "_Diastole";
         if (do_eval) {
             float s = eval.score(c.id, 1, v);
@@ -111,7 +118,8 @@ int main(int argc, char **argv) {
             }
         }
         cout << endl;
-        GaussianAcc(c.min, scale, &v);
+        v.assign(cdf.begin() + (2 * i + 1) * Eval::VALUES,
+                 cdf.begin() + (2 * i + 2) * Eval::VALUES);
         //
         cout << c.id << "_Systole";
         if (do_eval) {
@@ -1,4 +1,5 @@
 #include <sstream>
+#include <unistd.h>
 #include <unordered_set>
 #include <unordered_map>
 #include <iostream>
@@ -17,6 +18,7 @@
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/program_options.hpp>
+#include <boost/property_tree/xml_parser.hpp>
 #include <glog/logging.h>
 #include "adsb2.h"
 
@@ -70,6 +72,9 @@ class Xtor {
 public:
     ~Xtor () {}
     virtual bool apply (StudyReport const &rep, Sample *) const = 0;
+    // if apply can run concurrently on different studies
+    // with results independent of the order
+    virtual bool parallel () const { return true; }
     static Xtor *create (string const &name, Config const &conf);
 };
 
@@ -90,6 +95,11 @@ public:
     {
     }
 
+    // random_shuffle draws from one global sequence
+    bool parallel () const {
+        return sample <= 0;
+    }
+
     bool apply (StudyReport const &rep,
                 Sample *s) const {
         Study study(raw/fs::path(lexical_cast<string>(s->study))/fs::path("study"), false);
@@ -101,11 +111,22 @@ public:
         }
         if ((sample > 0) && (sample < slices.size())) {
             random_shuffle(slices.begin(), slices.end());
+            // of an archive only one slice is decoded, keep it
+            std::stable_partition(slices.begin(), slices.end(), [](Slice *sl) {
+                return sl->images[IM_RAW].data != nullptr;
+            });
             slices.resize(sample);
         }
         Meta meta;
         cv::Mat mat;
         for (auto sl: slices) {
+            if (sl->images[IM_RAW].data) {  // loaded from a raw pack or archive
+                meta = sl->meta;
+                mat = sl->images[IM_RAW];
+                break;
+            }
+            // archive members other than the decoded one
+            if (!fs::is_regular_file(sl->path)) continue;
             mat = load_dicom(sl->path, &meta);
             if (mat.data) break;
             LOG(ERROR) << "fail to load DICOM: " << sl->path;
@@ -428,8 +449,10 @@ void run_train (vector<Sample> &ss, int level, int mode, fs::path const &dir, un
             tp.max_round = conf.get<int>("adsb2.xg.max_round", 1500);
             tp.tolerate = conf.get<int>("adsb2.xg.tolerate", 0.5);
             tp.seed = conf.get<int>("adsb2.xg.seed", 2016);
-            xg::tune(train_path, tp, &tr);
+            fs::ofstream os_tune(dir/fs::path("tune"));
+            xg::tune(train_path, tp, &tr, os_tune);
             round = (tr.round1 + tr.round2) / 2;
+            LOG(INFO) << "tuned " << dir << ": " << tr.round1 << ' ' << tr.round2 << " -> " << round;
         }
         xg::Params params;
         params.round = round;
@@ -461,7 +484,8 @@ void eval_v (vector<float> const &v1,
     out->push_back(err);
 }
 
-void run_eval (vector<Sample> &ss, unordered_set<int> const &train) {
+// prints per-study scores and returns the mean CRPS
+float run_eval (vector<Sample> &ss, unordered_set<int> const &train, ostream &os) {
     Eval eval;
     int count = 0;
     float sum = 0;
@@ -480,14 +504,15 @@ void run_eval (vector<Sample> &ss, unordered_set<int> const &train) {
         float sys_x = eval.score(s.study, 0, s.sys_v);
         float dia_x = eval.score(s.study, 1, s.dia_v);
         sum += sys_x + dia_x;
-        cout << s.study << "_Systole" << '\t' << sys_x << '\t' << s.sys_t << '\t' << s.sys_p << '\t' << (s.sys_t - s.sys_p) << '\t' << s.sys_e << endl;
-        cout << s.study << "_Diastole" << '\t' << dia_x << '\t' << s.dia_t << '\t' << s.dia_p << '\t' << (s.dia_t - s.dia_p) << '\t' << s.dia_e << endl;
+        os << s.study << "_Systole" << '\t' << sys_x << '\t' << s.sys_t << '\t' << s.sys_p << '\t' << (s.sys_t - s.sys_p) << '\t' << s.sys_e << endl;
+        os << s.study << "_Diastole" << '\t' << dia_x << '\t' << s.dia_t << '\t' << s.dia_p << '\t' << (s.dia_t - s.dia_p) << '\t' << s.dia_e << endl;
         ++count;
     }
-    cout << sum / (count *2) << endl;
-    cout << "sys: " << sqrt(dsys / count) << endl;
-    cout << "dia: " << sqrt(ddia / count) << endl;
-    cout << "all: " << sqrt(dall / count/2) << endl;
+    os << sum / (count *2) << endl;
+    os << "sys: " << sqrt(dsys / count) << endl;
+    os << "dia: " << sqrt(ddia / count) << endl;
+    os << "all: " << sqrt(dall / count/2) << endl;
+    return sum / (count * 2);
 }
 
 void run_show (vector<Sample> const &samples) {
@@ -664,6 +689,112 @@ void preprocess (StudyReport *rep, bool detail, bool smooth, Config const &conf)
     }
 }
 
+// Cache of extracted features, one file per study under
+// <root>/<key>/, where key hashes everything extraction depends on
+// except the reports: xtor, buddy roots, flags and the whole config.
+// Each entry also records the size and mtime of the report files
+// it was built from, and is rebuilt when they change.
+class FeatureCache {
+    fs::path dir;
+
+    static void write_vector (ostream &os, vector<float> const &v) {
+        uint32_t n = v.size();
+        os.write(reinterpret_cast<char const *>(&n), sizeof(n));
+        os.write(reinterpret_cast<char const *>(v.data()), sizeof(float) * n);
+    }
+
+    static bool read_vector (istream &is, vector<float> *v) {
+        uint32_t n;
+        if (!is.read(reinterpret_cast<char *>(&n), sizeof(n))) return false;
+        if (n > 1000000) return false;
+        v->resize(n);
+        return bool(is.read(reinterpret_cast<char *>(v->data()), sizeof(float) * n));
+    }
+
+    template <typename T>
+    static void write_pod (ostream &os, T const &v) {
+        os.write(reinterpret_cast<char const *>(&v), sizeof(v));
+    }
+
+    template <typename T>
+    static bool read_pod (istream &is, T *v) {
+        return bool(is.read(reinterpret_cast<char *>(v), sizeof(*v)));
+    }
+
+    fs::path path (int study) const {
+        return dir / fs::path(lexical_cast<string>(study));
+    }
+public:
+    FeatureCache (fs::path const &root, string const &key) {
+        dir = root / fs::path(fmt::format("{:016x}", std::hash<string>()(key)));
+        fs::create_directories(dir);
+        fs::ofstream os(dir / fs::path("key"));
+        os << key;
+    }
+
+    // size and mtime of the report file of a study under a report root
+    static string stamp (fs::path const &root, int study) {
+        fs::path path = fs::is_regular_file(root) ? root
+                        : root / fs::path(lexical_cast<string>(study)) / fs::path("report.txt");
+        boost::system::error_code ec;
+        uintmax_t size = fs::file_size(path, ec);
+        if (ec) return path.native() + ":none;";
+        std::time_t mtime = fs::last_write_time(path, ec);
+        return fmt::format("{}:{}:{};", path.native(), size, mtime);
+    }
+
+    bool load (int study, string const &stamp, Sample *s) const {
+        fs::ifstream is(path(study), ios::binary);
+        if (!is) return false;
+        string st;
+        uint32_t n;
+        if (!read_pod(is, &n) || n != stamp.size()) return false;
+        st.resize(n);
+        if (!is.read(&st[0], n) || st != stamp) return false;
+        Sample x = *s;
+        int good;
+        bool ok = read_pod(is, &good)
+            && read_pod(is, &x.cohort)
+            && read_pod(is, &x.age)
+            && read_vector(is, &x.tft_sys)
+            && read_vector(is, &x.tft_dia)
+            && read_vector(is, &x.eft)
+            && read_pod(is, &x.sys1)
+            && read_pod(is, &x.dia1)
+            && read_pod(is, &x.sys2)
+            && read_pod(is, &x.dia2);
+        if (!ok) return false;
+        x.good = good;
+        *s = x;
+        return true;
+    }
+
+    void save (int study, string const &stamp, Sample const &s) const {
+        // write then rename, so concurrent runs never see partial files
+        fs::path tmp(path(study).native() + fmt::format(".{}.tmp", getpid()));
+        {
+            fs::ofstream os(tmp, ios::binary);
+            write_pod<uint32_t>(os, stamp.size());
+            os.write(stamp.data(), stamp.size());
+            write_pod<int>(os, s.good);
+            write_pod(os, s.cohort);
+            write_pod(os, s.age);
+            write_vector(os, s.tft_sys);
+            write_vector(os, s.tft_dia);
+            write_vector(os, s.eft);
+            write_pod(os, s.sys1);
+            write_pod(os, s.dia1);
+            write_pod(os, s.sys2);
+            write_pod(os, s.dia2);
+            if (!os) {
+                LOG(WARNING) << "fail to write feature cache " << tmp;
+                return;
+            }
+        }
+        fs::rename(tmp, path(study));
+    }
+};
+
 static inline bool check_normal (float v) {
     return (v > -1000) && (v < 1000);
 }
@@ -679,7 +810,7 @@ public:
     {
 
     }
-    bool apply (Sample &s) {
+    bool apply (Sample &s) const {
         bool good = true;;
         if (!s.fb.found) return true;
         if (!check_normal(s.sys_p)) {
@@ -752,6 +883,289 @@ public:
     }
 };
 
+// Target and error models plus the fallback rules, applied to
+// extracted samples.  Models are only needed up to level.
+struct Predictor {
+    Eval const &eval;
+    GaussianAcc const &gacc;
+    FallbackChecker const &fbcheck;
+    unordered_map<int, int> const &patch_cohort;
+    int level;
+    bool do_cohort;
+    bool is_one;
+    bool is_full;
+    float scale;
+    Classifier *target_sys[2];
+    Classifier *target_dia[2];
+    Classifier *error_sys;
+    Classifier *error_dia;
+
+    // one batched model call over the good samples of cohort c (all if c < 0)
+    static void predict (Classifier const *model, vector<Sample> &ss, vector<int> const &cid, int c,
+                         vector<float> Sample::*ft, float Sample::*out, float scale = 1) {
+        vector<unsigned> idx;
+        vector<float> X;
+        unsigned dim = 0;
+        for (unsigned i = 0; i < ss.size(); ++i) {
+            if (!ss[i].good) continue;
+            if (c >= 0 && cid[i] != c) continue;
+            vector<float> const &f = ss[i].*ft;
+            if (idx.empty()) dim = f.size();
+            CHECK(f.size() == dim);
+            X.insert(X.end(), f.begin(), f.end());
+            idx.push_back(i);
+        }
+        if (idx.empty()) return;
+        CHECK(model);
+        vector<float> y(idx.size());
+        model->apply(idx.size(), dim, X.data(), y.data());
+        for (unsigned k = 0; k < idx.size(); ++k) {
+            ss[idx[k]].*out = y[k] * scale;
+        }
+    }
+
+    // sets the targets and cohort, returns the cohort model to use
+    int prepare (Sample &s) const {
+        s.sys_t = eval.get(s.study, 0);
+        s.dia_t = eval.get(s.study, 1);
+        int c_id = 0;
+        if (do_cohort) {
+            c_id = s.cohort;
+            if (patch_cohort.size()) {
+                auto it = patch_cohort.find(s.study);
+                CHECK(it != patch_cohort.end());
+                c_id = s.cohort = it->second;
+            }
+        }
+        return c_id;
+    }
+
+    // fallbacks and CDFs, with the model outputs already in s
+    void finish (Sample &s) const {
+        if (s.good) {
+            if (level >= 1) {
+                s.sys_p_raw = s.sys_p;
+                s.dia_p_raw = s.dia_p;
+            }
+            if (level >= 2) {
+                s.sys_e_raw = s.sys_e;
+                s.dia_e_raw = s.dia_e;
+            }
+            // check fallback
+            if (s.fb.found) {
+                s.good &= fbcheck.apply(s);
+            }
+            if (is_one && s.fb.found) {
+                if ((s.dia_p * 2 <= s.fb.dia_p_raw)
+                     || (s.sys_e < 0) || (s.dia_e < 0) || (s.sys_p < 0)) {
+                    LOG(WARNING) << "Study " << s.study << " (one) not good, using fallback";
+                    s.sys_p = s.fb.sys_p;
+                    s.sys_e = s.fb.sys_e;
+                    s.dia_p = s.fb.dia_p;
+                    s.dia_e = s.fb.dia_e;
+                    s.good = false;
+                }
+            }
+            if (is_full && s.fb.found && s.fb2.found) {
+                float a = s.dia_p / (s.fb.dia_p_raw + s.fb2.dia_p_raw);
+                float b = s.dia_p / s.fb.dia_p_raw;    // one sax
+                float c = s.fb.dia_p / s.fb2.dia_p_raw;
+                if ((b < 0.6) && (s.age > 10)) {
+                    LOG(WARNING) << "Study " << s.study << "(full) not good, using fallback "
+                                 << s.dia_p << " => " << s.fb.dia_p << " (" << s.dia_t << ")";
+                    s.sys_p = s.fb.sys_p;
+                    s.sys_e = s.fb.sys_e;
+                    s.dia_p = s.fb.dia_p;
+                    s.dia_e = s.fb.dia_e;
+                    s.good = false;
+                }
+            }
+        }
+        else {
+            LOG(WARNING) << "Study " << s.study << " not good, using fallback";
+            if (s.fb.found) {
+                s.sys_p = s.fb.sys_p;
+                s.sys_e = s.fb.sys_e;
+                s.dia_p = s.fb.dia_p;
+                s.dia_e = s.fb.dia_e;
+                s.sys_p_raw = s.fb.sys_p;
+                s.sys_e_raw = s.fb.sys_e;
+                s.dia_p_raw = s.fb.dia_p;
+                s.dia_e_raw = s.fb.dia_e;
+            }
+            else {
+                LOG(WARNING) << "Study " << s.study << " doesn not have fallback, using global value.";
+                s.sys_p = global_fb.sys_p;
+                s.sys_e = global_fb.sys_e;
+                s.dia_p = global_fb.dia_p;
+                s.dia_e = global_fb.dia_e;
+
+                s.sys_p_raw = global_fb.sys_p;
+                s.sys_e_raw = global_fb.sys_e;
+                s.dia_p_raw = global_fb.dia_p;
+                s.dia_e_raw = global_fb.dia_e;
+            }
+        }
+        if (level >= 2) {
+            gacc.apply(s.sys_p, s.sys_e, &s.sys_v);
+            gacc.apply(s.dia_p, s.dia_e, &s.dia_v);
+        }
+    }
+
+    void apply (vector<Sample> &ss) const {
+        vector<int> cid(ss.size());
+        for (unsigned i = 0; i < ss.size(); ++i) {
+            cid[i] = prepare(ss[i]);
+        }
+        if (level >= 1) {
+            for (int c = 0; c < 2; ++c) {
+                predict(target_sys[c], ss, cid, c, &Sample::tft_sys, &Sample::sys_p);
+                predict(target_dia[c], ss, cid, c, &Sample::tft_dia, &Sample::dia_p);
+            }
+        }
+        if (level >= 2) {
+            predict(error_sys, ss, cid, -1, &Sample::eft, &Sample::sys_e, scale);
+            predict(error_dia, ss, cid, -1, &Sample::eft, &Sample::dia_e, scale);
+        }
+        for (auto &s: ss) {
+            finish(s);
+        }
+    }
+};
+
+void run_train1 (vector<Sample> const &samples, bool do_cohort, fs::path const &root,
+                 unordered_set<int> const &train_set, int round1, Config const &config) {
+    vector<Sample> c0, c1;
+    if (do_cohort) {
+        split_by_cohort(samples, &c0, &c1);
+    }
+    else {
+        c0 = samples;
+    }
+    run_train(c0, 1, 0, root/fs::path("d.target.sys.0"), train_set, root/fs::path("target.sys.0"), round1, config);
+    run_train(c0, 1, 1, root/fs::path("d.target.dia.0"), train_set, root/fs::path("target.dia.0"), round1, config);
+    if (do_cohort) {
+        run_train(c1, 1, 0, root/fs::path("d.target.sys.1"), train_set, root/fs::path("target.sys.1"), round1, config);
+        run_train(c1, 1, 1, root/fs::path("d.target.dia.1"), train_set, root/fs::path("target.dia.1"), round1, config);
+    }
+}
+
+void run_train2 (vector<Sample> &samples, fs::path const &root,
+                 unordered_set<int> const &train_set, int round2, Config const &config) {
+    run_train(samples, 2, 0, root/fs::path("d.error.sys"), train_set, root/fs::path("error.sys"), round2, config);
+    run_train(samples, 2, 1, root/fs::path("d.error.dia"), train_set, root/fs::path("error.dia"), round2, config);
+}
+
+// Copies the glog messages of a fold thread into the log of its
+// current stage, as run-val.sh used to keep per-fold logs.
+// Messages still go to stderr as well.
+class FoldLogSink: public google::LogSink {
+public:
+    static thread_local ostream *current;
+    virtual void send (google::LogSeverity severity, char const *full_filename,
+                       char const *base_filename, int line,
+                       struct ::tm const *tm_time,
+                       char const *message, size_t message_len) {
+        if (current) {
+            *current << ToString(severity, base_filename, line, tm_time, message, message_len) << endl;
+        }
+    }
+    struct Stage {
+        fs::ofstream os;
+        Stage (fs::path const &path): os(path) {
+            current = &os;
+        }
+        ~Stage () {
+            current = nullptr;
+        }
+    };
+};
+
+thread_local ostream *FoldLogSink::current = nullptr;
+
+// k-fold validation in one process, on features extracted once.
+// Fold i trains in <root>/val<i>, as run-val.sh used to do with
+// train1, train2 and eval; folds run concurrently.  Training samples
+// are shuffled with the permutation a fresh touchup --shuffle uses.
+// Fold logs go to val<i>/train1.log, train2.log and val.err, tuning
+// to val<i>/d.*/tune, so stdout has only the scores.
+void run_kfold (vector<Sample> const &samples, Predictor const &base,
+                vector<fs::path> const &folds, fs::path const &root,
+                int round1, int round2, bool do_cohort, bool shuffle,
+                Config const &config) {
+    CHECK(folds.size()) << "kfold needs --fold";
+    vector<unsigned> order(samples.size());
+    for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+    if (shuffle) {
+        random_shuffle(order.begin(), order.end());
+    }
+    vector<float> scores(folds.size());
+    FoldLogSink sink;
+    google::AddLogSink(&sink);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned f = 0; f < folds.size(); ++f) {
+        fs::path dir = root / fs::path(fmt::format("val{}", f + 1));
+        fs::create_directories(dir);
+        unordered_set<int> train_set;
+        {
+            int x;
+            fs::ifstream is(folds[f]);
+            CHECK(is) << "cannot open fold " << folds[f];
+            while (is >> x) {
+                train_set.insert(x);
+            }
+        }
+        Predictor pred = base;
+        auto predict = [&pred, &samples](vector<Sample> *ss, vector<unsigned> const *perm) {
+            ss->clear();
+            for (unsigned i = 0; i < samples.size(); ++i) {
+                ss->push_back(samples[perm ? perm->at(i) : i]);
+            }
+            pred.apply(*ss);
+        };
+        vector<Sample> ss;
+        {
+            FoldLogSink::Stage stage(dir/fs::path("train1.log"));
+            pred.level = 0;
+            predict(&ss, &order);
+            run_train1(ss, do_cohort, dir, train_set, round1, config);
+        }
+
+        {
+            FoldLogSink::Stage stage(dir/fs::path("train2.log"));
+            pred.level = 1;
+            for (int c = 0; c < (do_cohort ? 2 : 1); ++c) {
+                pred.target_sys[c] = make_xgboost_classifier(dir/fs::path(fmt::format("target.sys.{}", c)));
+                pred.target_dia[c] = make_xgboost_classifier(dir/fs::path(fmt::format("target.dia.{}", c)));
+            }
+            predict(&ss, &order);
+            run_train2(ss, dir, train_set, round2, config);
+        }
+        {
+            FoldLogSink::Stage stage(dir/fs::path("val.err"));
+            pred.level = 2;
+            pred.error_sys = make_xgboost_classifier(dir/fs::path("error.sys"));
+            pred.error_dia = make_xgboost_classifier(dir/fs::path("error.dia"));
+            predict(&ss, nullptr);
+            fs::ofstream os(dir/fs::path("eval.log"));
+            scores[f] = run_eval(ss, train_set, os);
+        }
+        for (int c = 0; c < 2; ++c) {
+            delete pred.target_sys[c];
+            delete pred.target_dia[c];
+        }
+        delete pred.error_sys;
+        delete pred.error_dia;
+    }
+    google::RemoveLogSink(&sink);
+    float sum = 0;
+    for (unsigned f = 0; f < folds.size(); ++f) {
+        cout << "val" << (f + 1) << '\t' << folds[f].native() << '\t' << scores[f] << endl;
+        sum += scores[f];
+    }
+    cout << "mean\t" << sum / folds.size() << endl;
+}
+
 int main(int argc, char **argv) {
     namespace po = boost::program_options; 
     string config_path;
@@ -767,6 +1181,8 @@ int main(int argc, char **argv) {
     vector<fs::path> buddy_roots;
     fs::path fallback_path;
     fs::path fallback2_path;
+    fs::path cache_root;
+    vector<fs::path> folds;
     int round1, round2;
     float scale;
     int CASE;
@@ -784,7 +1200,7 @@ int main(int argc, char **argv) {
     ("round1", po::value(&round1)->default_value(-1), "")
     ("round2", po::value(&round2)->default_value(-1), "")
     ("shuffle", "")
-    ("data", po::value(&data_root), "dir containing report files")
+    ("data", po::value(&data_root), "dir containing report files, or a store built by pack-report")
     ("ws,w", po::value(&root), "working directory")
     ("fallback", po::value(&fallback_path), "")
     ("fallback2", po::value(&fallback2_path), "")
@@ -795,6 +1211,8 @@ int main(int argc, char **argv) {
     ("xa", "")
     ("no-smooth", "")
     ("case", po::value(&CASE)->default_value(0), "")
+    ("cache", po::value(&cache_root), "feature cache directory, shared by runs")
+    ("fold", po::value(&folds), "kfold: training ID list of each fold")
     ;
 
     po::positional_options_description p;
@@ -888,6 +1306,7 @@ int main(int argc, char **argv) {
     else if (method == "eval") level = 2;
     else if (method == "pred") level = 2;
     else if (method == "submit") level = 2;
+    else if (method == "kfold") level = 0;    // models are trained per fold
     else CHECK(0) << "method " << method << " not supported";
 
     Classifier *target_sys[2] = {0, 0};
@@ -908,10 +1327,43 @@ int main(int argc, char **argv) {
     }
 
     FallbackChecker fbcheck(config);
+    Predictor predictor{eval, gacc, fbcheck, patch_cohort, level, do_cohort, is_one, is_full, scale,
+                        {target_sys[0], target_sys[1]}, {target_dia[0], target_dia[1]},
+                        error_sys, error_dia};
+
+    ReportLoader loader(data_root);
+    vector<std::unique_ptr<ReportLoader>> buddy_loaders;
+    for (auto const &buddy_root: buddy_roots) {
+        buddy_loaders.emplace_back(new ReportLoader(buddy_root));
+    }
+
+    std::unique_ptr<FeatureCache> cache;
+    if (!cache_root.empty()) {
+        if (xtor->parallel()) {
+            ostringstream key;
+            key << VERSION << '\n' << xtor_name << '\n'
+                << do_detail << do_smooth << do_xa << ' ' << CASE << '\n';
+            for (auto const &buddy_root: buddy_roots) {
+                key << "buddy " << fs::absolute(buddy_root).native() << '\n';
+            }
+            Config c = config;
+            c.get_child("adsb2").erase("models");   // per workspace, not used by xtors
+            boost::property_tree::write_xml(key, c);
+            cache.reset(new FeatureCache(cache_root, key.str()));
+        }
+        else {
+            LOG(WARNING) << "xtor " << xtor_name << " is not deterministic, feature cache disabled.";
+        }
+    }
 
     fs::create_directories(root);
-    for (auto const &study: studies) {
-        Sample s;
+    // feature extraction is independent per study, run it in parallel
+    // and keep the input order so output files do not change
+    samples.resize(studies.size());
+#pragma omp parallel for schedule(dynamic, 1) if (xtor->parallel())
+    for (unsigned i = 0; i < studies.size(); ++i) {
+        int study = studies[i];
+        Sample &s = samples[i];
         s.study = study;
         s.good = true;
         s.cohort = 0;
@@ -932,10 +1384,18 @@ int main(int argc, char **argv) {
             }
         }
 
-        fs::path path(data_root / fs::path(lexical_cast<string>(study))/ fs::path("report.txt"));
-        StudyReport x(path);
-        if (x.empty()) {
-            LOG(ERROR) << "Fail to load data file: " << path.native();
+        string stamp;
+        if (cache) {
+            stamp = FeatureCache::stamp(data_root, study);
+            for (auto const &buddy_root: buddy_roots) {
+                stamp += FeatureCache::stamp(buddy_root, study);
+            }
+            if (cache->load(study, stamp, &s)) continue;
+        }
+
+        StudyReport x;
+        if (!loader.load(study, &x)) {
+            LOG(ERROR) << "Fail to load data file: " << loader.describe(study).native();
         }
 #if 0
         if (do_cohort) {
@@ -953,11 +1413,10 @@ int main(int argc, char **argv) {
         s.good = s.good && xtor->apply(x, &s);
         if (s.good && (!buddy_roots.empty())) {
             CHECK(xtor_name == "full");
-            for (auto const &buddy_root: buddy_roots) {
-                fs::path buddy_path = buddy_root / fs::path(lexical_cast<string>(s.study)) / fs::path("report.txt");
-                StudyReport bx(buddy_path);
-                if (bx.empty()) {
-                    LOG(ERROR) << "Fail to load data file: " << buddy_path.native();
+            for (auto const &buddy_loader: buddy_loaders) {
+                StudyReport bx;
+                if (!buddy_loader->load(s.study, &bx)) {
+                    LOG(ERROR) << "Fail to load data file: " << buddy_loader->describe(s.study).native();
                 }
                 preprocess(&bx, do_detail, do_smooth, config);
                 Sample bs;
@@ -1034,93 +1493,20 @@ int main(int argc, char **argv) {
                 }
             }
         }
-
-        s.sys_t = eval.get(s.study, 0);
-        s.dia_t = eval.get(s.study, 1);
-        int c_id = 0;
-        if (do_cohort) {
-            c_id = s.cohort;
-            if (patch_cohort.size()) {
-                auto it = patch_cohort.find(s.study);
-                CHECK(it != patch_cohort.end());
-                c_id = s.cohort = it->second;
-            }
+        if (cache) {
+            cache->save(study, stamp, s);
         }
-        if (s.good) {
-            if (level >= 1) {
-                s.sys_p = target_sys[c_id]->apply(s.tft_sys);
-                s.dia_p = target_dia[c_id]->apply(s.tft_dia);
-                s.sys_p_raw = s.sys_p;
-                s.dia_p_raw = s.dia_p;
-            }
-            if (level >= 2) {
-                s.sys_e = error_sys->apply(s.eft) * scale;
-                s.dia_e = error_dia->apply(s.eft) * scale;
-                s.sys_e_raw = s.sys_e;
-                s.dia_e_raw = s.dia_e;
-            }
-            // check fallback
-            if (s.fb.found) {
-                s.good &= fbcheck.apply(s);
-            }
-            if (is_one && s.fb.found) {
-                if ((s.dia_p * 2 <= s.fb.dia_p_raw)
-                     || (s.sys_e < 0) || (s.dia_e < 0) || (s.sys_p < 0)) {
-                    LOG(WARNING) << "Study " << s.study << " (one) not good, using fallback";
-                    s.sys_p = s.fb.sys_p;
-                    s.sys_e = s.fb.sys_e;
-                    s.dia_p = s.fb.dia_p;
-                    s.dia_e = s.fb.dia_e;
-                    s.good = false;
-                }
-            }
-            if (is_full && s.fb.found && s.fb2.found) {
-                float a = s.dia_p / (s.fb.dia_p_raw + s.fb2.dia_p_raw);
-                float b = s.dia_p / s.fb.dia_p_raw;    // one sax
-                float c = s.fb.dia_p / s.fb2.dia_p_raw;
-                if ((b < 0.6) && (s.age > 10)) {
-                    LOG(WARNING) << "Study " << s.study << "(full) not good, using fallback "
-                                 << s.dia_p << " => " << s.fb.dia_p << " (" << s.dia_t << ")";
-                    s.sys_p = s.fb.sys_p;
-                    s.sys_e = s.fb.sys_e;
-                    s.dia_p = s.fb.dia_p;
-                    s.dia_e = s.fb.dia_e;
-                    s.good = false;
-                }
-            }
-        }
-        else {
-            LOG(WARNING) << "Study " << s.study << " not good, using fallback";
-            if (s.fb.found) {
-                s.sys_p = s.fb.sys_p;
-                s.sys_e = s.fb.sys_e;
-                s.dia_p = s.fb.dia_p;
-                s.dia_e = s.fb.dia_e;
-                s.sys_p_raw = s.fb.sys_p;
-                s.sys_e_raw = s.fb.sys_e;
-                s.dia_p_raw = s.fb.dia_p;
-                s.dia_e_raw = s.fb.dia_e;
-            }
-            else {
-                LOG(WARNING) << "Study " << s.study << " doesn not have fallback, using global value.";
-                s.sys_p = global_fb.sys_p;
-                s.sys_e = global_fb.sys_e;
-                s.dia_p = global_fb.dia_p;
-                s.dia_e = global_fb.dia_e;
+    }
 
-                s.sys_p_raw = global_fb.sys_p;
-                s.sys_e_raw = global_fb.sys_e;
-                s.dia_p_raw = global_fb.dia_p;
-                s.dia_e_raw = global_fb.dia_e;
-            }
-        }
-        if (level >= 2) {
-            gacc.apply(s.sys_p, s.sys_e, &s.sys_v);
-            gacc.apply(s.dia_p, s.dia_e, &s.dia_v);
-        }
-        samples.push_back(s);
+    if (method == "kfold") {
+        run_kfold(samples, predictor, folds, root, round1, round2,
+                  do_cohort, vm.count("shuffle") > 0, config);
+        delete xtor;
+        return 0;
     }
 
+    predictor.apply(samples);
+
     if (vm.count("shuffle")){
         random_shuffle(samples.begin(), samples.end());
     }
@@ -1129,26 +1515,13 @@ int main(int argc, char **argv) {
         run_show(samples);
     }
     if (method == "train1") {
-        vector<Sample> c0, c1;
-        if (do_cohort) {
-            split_by_cohort(samples, &c0, &c1);
-        }
-        else {
-            c0 = samples;
-        }
-        run_train(c0, 1, 0, root/fs::path("d.target.sys.0"), train_set, root/fs::path("target.sys.0"), round1, config);
-        run_train(c0, 1, 1, root/fs::path("d.target.dia.0"), train_set, root/fs::path("target.dia.0"), round1, config);
-        if (do_cohort) {
-            run_train(c1, 1, 0, root/fs::path("d.target.sys.1"), train_set, root/fs::path("target.sys.1"), round1, config);
-            run_train(c1, 1, 1, root/fs::path("d.target.dia.1"), train_set, root/fs::path("target.dia.1"), round1, config);
-        }
+        run_train1(samples, do_cohort, root, train_set, round1, config);
     }
     else if (method == "train2") {
-        run_train(samples, 2, 0, root/fs::path("d.error.sys"), train_set, root/fs::path("error.sys"), round2, config);
-        run_train(samples, 2, 1, root/fs::path("d.error.dia"), train_set, root/fs::path("error.dia"), round2, config);
+        run_train2(samples, root, train_set, round2, config);
     }
     else if (method == "eval") {
-        run_eval(samples, train_set);
+        run_eval(samples, train_set, cout);
     }
     else if (method == "pred") {
         run_pred(samples);
@@ -131,7 +131,7 @@ namespace adsb2 { namespace xg {
         return r1.begin < r2.begin;
     }
 
-    void tune (fs::path const &path, TuneParams const &tp, TuneResult *result) {
+    void tune (fs::path const &path, TuneParams const &tp, TuneResult *result, std::ostream &os) {
         vector<string> lines;
         {
             fs::ifstream is(path);
@@ -183,7 +183,7 @@ namespace adsb2 { namespace xg {
         fs::remove(temp_test);
         sort(opts.begin(), opts.end());
         for (auto const &p: opts) {
-            std::cout << p.begin << '\t' << p.opt << '\t' << p.end << '\t' << p.rmse << '\t' << p.max << std::endl;
+            os << p.begin << '\t' << p.opt << '\t' << p.end << '\t' << p.rmse << '\t' << p.max << std::endl;
         }
         vector<int> vote(tp.max_round, 0);
         for (auto const &p: opts) {
@@ -203,7 +203,7 @@ namespace adsb2 { namespace xg {
         }
         result->round1 = std::max((lb + ub)/2, 2);
         result->round2 = std::max(int(std::min_element(sum.begin(), sum.end()) - sum.begin()),2);
-        std::cout << lb << '\t' << ub << '\t' << result->round1 << '\t' << result->round2 << std::endl;
+        os << lb << '\t' << ub << '\t' << result->round1 << '\t' << result->round2 << std::endl;
     }
 
 }}
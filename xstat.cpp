@@ -40,7 +40,7 @@ int main(int argc, char **argv) {
     ("config", po::value(&config_path)->default_value("adsb2.xml"), "config file")
     ("override,D", po::value(&overrides), "override configuration.")
     ("input,i", po::value(&studies), "report files")
-    ("data", po::value(&data_root), "dir containing report files")
+    ("data", po::value(&data_root), "dir containing report files, or a store built by pack-report")
     ;
 
     po::positional_options_description p;
@@ -74,10 +74,10 @@ int main(int argc, char **argv) {
     OverrideConfig(overrides, &config);
     GlobalInit(argv[0], config);
 
+    ReportLoader loader(data_root);
     for (auto const &study: studies) {
-        fs::path path(data_root / fs::path(lexical_cast<string>(study))/ fs::path("report.txt"));
-        StudyReport x(path);
-        if (x.empty()) {
+        StudyReport x;
+        if (!loader.load(study, &x)) {
             continue;
         }
         for (auto const &sax: x) {